@@ -0,0 +1,236 @@
+/*
+ * detect_efi_boot_partition
+ *  Batch resolution over a manifest of VMs(--batch)
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <condition_variable>
+
+#include "batch.h"
+#include "boot_option.h"
+#include "varstore.h"
+#include "disk_image.h"
+#include "result_cache.h"
+#include "metrics.h"
+#include "json.h"
+
+static const size_t output_chunk = 1024 * 1024;    // written once this much has piled up
+static const size_t output_backlog = 4 * output_chunk;  // workers wait rather than pile up more while writing lags
+static const size_t window_per_thread = 16;         // ordered: lines a worker may run ahead of the output, per worker
+
+// a --record-efivars snapshot by its magic, an EDK2 variable store otherwise
+static std::unique_ptr<efivar_source> open_efivar_file(const std::string& path)
+{
+    char magic[8] = {};
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+    //else
+    auto r = ::pread(fd, magic, sizeof(magic), 0);
+    ::close(fd);
+    if (r == sizeof(magic) && memcmp(magic, "EFIVARS", sizeof(magic)) == 0) return std::make_unique<efivar_snapshot>(path);
+    //else
+    return std::make_unique<edk2_varstore>(path);
+}
+
+// fills in result: the members following "image", whether the partition was found and the regions of the image read.
+// Members known by the time of a failure are left in result.json.
+static void resolve_entry_uncached(const std::string& vars, const std::string& image, cached_result& result)
+{
+    auto efivars = open_efivar_file(vars);
+    auto query = boot_partition_query(*efivars);
+    result.json += ",\"partuuid\":" + json_quote(query.partuuid);
+    auto reader = open_image(image);
+    region_recorder recorder(*reader);
+    auto table = read_partition_table(recorder);
+    result.regions = recorder.regions();
+    result.crc = recorder.crc();
+    if (table) {
+        for (const auto& part : table->partitions) {
+            if (part.id != query.id) continue;
+            //else
+            result.json += ",\"partno\":" + std::to_string(part.partno) + ",\"start\":" + std::to_string(part.start)
+                + ",\"size\":" + std::to_string(part.size);
+            result.ok = true;
+            return;
+        }
+    }
+    throw detection_error(failure_reason::partition_not_found, "Partition not found in the image");
+}
+
+// one result line; ok tells whether the partition was found, cached whether the result came from options.cache
+static std::string resolve_entry(const std::string& line, size_t line_number, const batch_options& options, bool& ok, bool& cached)
+{
+    std::string json = "{\"line\":" + std::to_string(line_number);
+    ok = cached = false;
+    try {
+        auto members = parse_json_string_object(line);
+        if (!members) throw std::runtime_error("Manifest line is not a JSON object of strings");
+        //else
+        auto id = members->find("id"), vars = members->find("vars"), image = members->find("image");
+        if (id != members->end()) json += ",\"id\":" + json_quote(id->second);
+        if (vars == members->end() || image == members->end()) throw std::runtime_error("Manifest entry needs \"vars\" and \"image\"");
+        //else
+        json += ",\"vars\":" + json_quote(vars->second) + ",\"image\":" + json_quote(image->second);
+        std::string key;
+        if (options.cache) {
+            // stat before reading so that a file changing meanwhile gets a stale identity, never a stale result;
+            // a backing file is stat'ed as soon as the header naming it has been read
+            auto vars_identity = file_identity::of(vars->second), image_identity = file_identity::of(image->second);
+            std::vector<file_identity> backing;
+            for (const auto& file : image_backing_files(image->second)) backing.push_back(file_identity::of(file));
+            key = result_cache::key(vars_identity, image_identity, backing);
+            auto hit = options.cache->find(key);
+            if (hit && options.verify_cache) {
+                auto reader = open_image(image->second);
+                if (!regions_unchanged(*reader, *hit)) {
+                    trace(image->second, ": partition table region changed, identity didn't");
+                    hit.reset();
+                }
+            }
+            if (hit) {
+                ok = hit->ok;
+                cached = true;
+                return json + hit->json + ",\"cached\":true}\n";
+            }
+        }
+        //else
+        cached_result result;
+        bool cacheable = true;
+        try {
+            resolve_entry_uncached(vars->second, image->second, result);
+        }
+        catch (const std::runtime_error& e) {
+            result.json += ",\"error\":" + json_quote(e.what());
+            // a detection_error follows from the contents of the files as a success does; I/O errors and the like don't
+            cacheable = dynamic_cast<const detection_error*>(&e) != nullptr;
+        }
+        if (options.cache && cacheable) options.cache->store(key, result);
+        ok = result.ok;
+        json += result.json;
+    }
+    catch (const std::runtime_error& e) {
+        json += ",\"error\":" + json_quote(e.what());
+    }
+    return json + "}\n";
+}
+
+static void write_all(int fd, const std::string& data)
+{
+    for (size_t written = 0; written < data.size();) {
+        auto r = ::write(fd, data.data() + written, data.size() - written);
+        if (r < 0 && errno == EINTR) continue;
+        //else
+        if (r < 0) throw std::runtime_error(std::string("Cannot write batch results: ") + strerror(errno));
+        //else
+        written += r;
+    }
+}
+
+batch_summary run_batch(std::istream& manifest, int out_fd, const batch_options& options)
+{
+    const bool ordered = options.ordered;
+    auto threads = options.threads;
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    const size_t window = threads * window_per_thread;
+
+    // everything below is guarded by mutex; the manifest is read line by line as workers ask for more
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t lines_taken = 0;         // handed out to workers
+    size_t lines_written = 0;       // ordered: results up to here are in out
+    std::map<size_t, std::string> pending;  // ordered: results waiting for those of earlier lines
+    std::string out;
+    bool writing = false;           // a worker is writing out what it took from out; nobody else writes meanwhile
+    bool end_of_manifest = false;
+    std::exception_ptr write_error;
+    batch_summary summary;
+
+    // called with lock held; the write itself goes on without it so that a slow stdout holds up only this worker.
+    // What piles up meanwhile is left in out for the writer to take next, which keeps the output in order.
+    auto flush = [&](std::unique_lock<std::mutex>& lock, bool force) {
+        while (!writing && !write_error && !out.empty() && (force || out.size() >= output_chunk)) {
+            std::string chunk;
+            chunk.swap(out);
+            writing = true;
+            lock.unlock();
+            std::exception_ptr error;
+            try {
+                write_all(out_fd, chunk);
+            }
+            catch (const std::runtime_error&) {
+                error = std::current_exception();
+            }
+            lock.lock();
+            writing = false;
+            if (error) write_error = error;
+            cv.notify_all();
+        }
+    };
+
+    auto worker = [&]() {
+        std::string line;
+        while (true) {
+            size_t index;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() {
+                    return ((!ordered || lines_taken < lines_written + window) && out.size() < output_backlog)
+                        || end_of_manifest || write_error;
+                });
+                if (end_of_manifest || write_error) return;
+                //else
+                if (!std::getline(manifest, line)) {
+                    end_of_manifest = true;
+                    return;
+                }
+                //else
+                index = lines_taken++;
+            }
+            bool blank = line.find_first_not_of(" \t\r") == std::string::npos;
+            bool ok = true, cached = false;
+            auto result = blank? std::string() : resolve_entry(line, index + 1, options, ok, cached);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!blank) {
+                summary.entries++;
+                if (!ok) summary.failed++;
+                if (cached) summary.cached++;
+            }
+            if (!ordered) {
+                out += result;
+            } else {
+                pending.emplace(index, std::move(result));
+                for (auto i = pending.begin(); i != pending.end() && i->first == lines_written; i = pending.erase(i)) {
+                    out += i->second;
+                    lines_written++;
+                }
+                cv.notify_all();
+            }
+            flush(lock, false);
+        }
+    };
+
+    trace("resolving manifest entries on ", threads, " threads, ", ordered? "ordered" : "unordered", " output");
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < threads; i++) workers.emplace_back(worker);
+    worker();   // this thread is one of them
+    for (auto& w : workers) w.join();
+    std::unique_lock<std::mutex> lock(mutex);
+    flush(lock, true);
+    if (write_error) std::rethrow_exception(write_error);
+    //else
+    return summary;
+}
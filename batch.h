@@ -0,0 +1,39 @@
+/*
+ * detect_efi_boot_partition
+ *  Batch resolution over a manifest of VMs(--batch)
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <stddef.h>
+
+#include <istream>
+
+class result_cache;
+
+struct batch_options {
+    bool ordered = true;
+    unsigned int threads = 0;       // 0: one per core
+    result_cache* cache = nullptr;  // results of unchanged vars/image pairs are taken from here
+    bool verify_cache = false;      // ...only after hashing the image's partition table region again
+};
+
+struct batch_summary {
+    size_t entries = 0;
+    size_t failed = 0;
+    size_t cached = 0;  // taken from batch_options::cache
+};
+
+// Resolves the boot partition of every VM manifest lists, one JSON object per line:
+//   {"vars": <efivars snapshot(--record-efivars) or OVMF_VARS.fd>, "image": <raw, qcow2 or compressed raw disk image>, "id": <optional>}
+// and writes one JSON object per entry to out_fd, in manifest order if ordered, as they complete otherwise.
+// Entries are spread over `threads` workers which take manifest lines as they become free;
+// with ordered, no worker runs more than a window of lines ahead of the output, so memory stays bounded
+// whatever the length of the manifest. Output is written in large chunks. Throws when out_fd can't be written.
+// With a cache, an entry whose files have the same device, inode, size and mtime as when it was last resolved
+// is answered from the cache("cached":true) without reading either file.
+batch_summary run_batch(std::istream& manifest, int out_fd, const batch_options& options = {});
+
+#endif // __BATCH_H__
@@ -0,0 +1,173 @@
+/*
+ * detect_efi_boot_partition
+ *  Boot configuration export(efivars as NDJSON)
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <stdio.h>
+
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+#include <string_view>
+
+#include "boot_config.h"
+#include "device_path.h"
+#include "utf16.h"
+#include "json.h"
+
+static const std::string_view global_variable_suffix = "-8be4df61-93ca-11d2-aa0d-00e098032b8c";
+
+enum class variable_kind { none, load_option, order, option_number, timeout };
+
+static bool is_option_number(std::string_view s)
+{
+    return s.size() == 4 && std::all_of(s.begin(), s.end(), [](char c) { return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'F'); });
+}
+
+// name without the GUID suffix
+static variable_kind classify(std::string_view name)
+{
+    for (std::string_view prefix : { "Boot", "Driver", "SysPrep", "PlatformRecovery" }) {
+        if (name.size() == prefix.size() + 4 && name.substr(0, prefix.size()) == prefix
+            && is_option_number(name.substr(prefix.size()))) return variable_kind::load_option;
+    }
+    //else
+    if (name == "BootOrder") return variable_kind::order;
+    if (name == "BootNext" || name == "BootCurrent") return variable_kind::option_number;
+    if (name == "Timeout") return variable_kind::timeout;
+    //else
+    return variable_kind::none;
+}
+
+std::vector<std::string> list_boot_variables(const efivar_source& efivars)
+{
+    std::vector<std::string> names;
+    for (std::string_view name : efivars.list()) {
+        if (name.size() <= global_variable_suffix.size()
+            || name.substr(name.size() - global_variable_suffix.size()) != global_variable_suffix) continue;
+        //else
+        name.remove_suffix(global_variable_suffix.size());
+        if (classify(name) != variable_kind::none) names.emplace_back(name);
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+static inline uint16_t u16(const uint8_t* p) { return p[0] | p[1] << 8; }
+static inline uint32_t u32(const uint8_t* p) { return u16(p) | (uint32_t)u16(p + 2) << 16; }
+
+static std::string option_number(uint16_t n)
+{
+    char buf[8];
+    sprintf(buf, "%04X", n);
+    return json_quote(buf);
+}
+
+// EFI_LOAD_OPTION: attributes, length of path list, description(UTF-16), path list, optional data
+static std::string load_option_to_json(const uint8_t* d, size_t len)
+{
+    if (len < 6) return "\"error\":\"truncated\"";
+    //else
+    auto attributes = u32(d);
+    size_t path_list_len = u16(d + 4);
+    const uint8_t* end = d + len;
+    const uint8_t* desc = d + 6;
+    const uint8_t* p = desc;
+    while (end - p >= 2 && (p[0] || p[1])) p += 2;
+    if (end - p < 2) return "\"error\":\"unterminated description\"";
+    //else
+    char description[1024];
+    auto desc_len = utf16le_to_utf8(desc, p - desc, description, sizeof(description));
+    p += 2;
+    if (path_list_len > (size_t)(end - p)) return "\"error\":\"path list exceeds variable\"";
+    //else
+    auto category = (attributes & 0x1f00) >> 8;
+    std::string json = std::string("\"active\":") + ((attributes & 0x1)? "true" : "false")
+        + ",\"force_reconnect\":" + ((attributes & 0x2)? "true" : "false")
+        + ",\"hidden\":" + ((attributes & 0x8)? "true" : "false")
+        + ",\"category\":" + (category == 0? "\"boot\"" : category == 1? "\"app\"" : std::to_string(category))
+        + ",\"description\":" + (desc_len? json_quote(std::string_view(description, *desc_len)) : "null")
+        + ",\"device_paths\":[";
+    for (size_t pos = 0; pos < path_list_len;) {
+        auto size = device_path_size(p + pos, path_list_len - pos);
+        if (pos > 0) json += ",";
+        if (size == 0) {   // malformed: render what there is, ending in "?"
+            json += json_quote(device_path_text(p + pos, path_list_len - pos));
+            break;
+        }
+        //else
+        json += json_quote(device_path_text(p + pos, size));
+        pos += size;
+    }
+    return json + "],\"optional_data_length\":" + std::to_string(end - p - path_list_len);
+}
+
+std::string boot_variable_to_json(const std::string& name, const uint8_t* data, size_t len)
+{
+    std::string json = "{\"name\":" + json_quote(name);
+    if (len < 4) return json + ",\"error\":\"truncated\"}";
+    //else
+    json += ",\"attributes\":" + std::to_string(u32(data)) + ",";
+    const uint8_t* d = data + 4;
+    len -= 4;
+    switch (classify(name)) {
+    case variable_kind::load_option:
+        json += load_option_to_json(d, len);
+        break;
+    case variable_kind::order:
+        json += "\"value\":[";
+        for (size_t i = 0; i + 2 <= len; i += 2) {
+            if (i) json += ",";
+            json += option_number(u16(d + i));
+        }
+        json += "]";
+        break;
+    case variable_kind::option_number:
+        json += len >= 2? "\"value\":" + option_number(u16(d)) : "\"error\":\"truncated\"";
+        break;
+    case variable_kind::timeout:
+        json += len >= 2? "\"value\":" + std::to_string(u16(d)) : "\"error\":\"truncated\"";
+        break;
+    case variable_kind::none:
+        json += "\"error\":\"not a boot manager variable\"";
+        break;
+    }
+    return json + "}";
+}
+
+std::string export_boot_config(const efivar_source& efivars, unsigned int threads)
+{
+    auto names = list_boot_variables(efivars);
+
+    // firmware services every variable read(SMM traps on some machines), so they are slow
+    // and are spread over a few threads; one slot per variable keeps the output sorted
+    std::vector<std::string> lines(names.size());
+    std::atomic<size_t> next = 0;
+    auto worker = [&]() {
+        for (size_t i; (i = next++) < names.size();) {
+            try {
+                auto contents = efivars.read(names[i] + std::string(global_variable_suffix));
+                if (!contents) lines[i] = "{\"name\":" + json_quote(names[i]) + ",\"error\":\"vanished\"}";
+                else lines[i] = boot_variable_to_json(names[i], contents->data(), contents->size());
+            }
+            catch (const std::runtime_error& e) {
+                lines[i] = "{\"name\":" + json_quote(names[i]) + ",\"error\":" + json_quote(e.what()) + "}";
+            }
+        }
+    };
+    threads = (unsigned int)std::min<size_t>(std::max(1u, threads), names.size());
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < threads; i++) workers.emplace_back(worker);
+    if (threads > 0) worker();
+    for (auto& w : workers) w.join();
+
+    std::string ndjson;
+    for (const auto& line : lines) {
+        if (!ndjson.empty()) ndjson += "\n";
+        ndjson += line;
+    }
+    return ndjson;
+}
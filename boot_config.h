@@ -0,0 +1,25 @@
+/*
+ * detect_efi_boot_partition
+ *  Boot configuration export(efivars as NDJSON)
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __BOOT_CONFIG_H__
+#define __BOOT_CONFIG_H__
+
+#include <string>
+#include <vector>
+
+#include "efivars.h"
+
+// names(without vendor GUID) of the boot manager variables: Boot####, Driver####, SysPrep####,
+// PlatformRecovery####, BootOrder, BootNext, BootCurrent and Timeout, sorted
+std::vector<std::string> list_boot_variables(const efivar_source& efivars);
+
+// one JSON object(no newline) per variable: attributes and the decoded value
+std::string boot_variable_to_json(const std::string& name, const uint8_t* data, size_t len);
+
+// every boot manager variable as NDJSON, read by up to `threads` workers
+std::string export_boot_config(const efivar_source& efivars, unsigned int threads = 4);
+
+#endif // __BOOT_CONFIG_H__
@@ -0,0 +1,210 @@
+/*
+ * detect_efi_boot_partition
+ *  Reading the current boot option out of EFI variables
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <endian.h>
+#include <ctype.h>
+#include <string.h>
+#include <limits.h>
+
+#include <optional>
+#include <algorithm>
+#include <stdexcept>
+
+#include "boot_option.h"
+#include "metrics.h"
+#include "utf16.h"
+#include "device_path.h"
+
+// sequential reads through an EFI variable's contents
+struct variable_cursor {
+    std::vector<uint8_t> contents;
+    size_t pos = 0;
+};
+
+static inline void read(variable_cursor& var, void* buf, size_t size)
+{
+    if (var.contents.size() - var.pos < size) throw detection_error(failure_reason::truncated_variable, "Boundary exceeded(EFI bug?)");
+    //else
+    memcpy(buf, var.contents.data() + var.pos, size);
+    var.pos += size;
+}
+
+template <typename T> static T read(variable_cursor& var)
+{
+    T buf;
+    read(var, &buf, sizeof(buf));
+    return buf;
+}
+
+static inline uint16_t read_le16(variable_cursor& var) { return le16toh(read<uint16_t>(var)); }
+static inline uint32_t read_le32(variable_cursor& var) { return le32toh(read<uint32_t>(var)); }
+static inline uint64_t read_le64(variable_cursor& var) { return le64toh(read<uint64_t>(var)); }
+
+static std::optional<partition_query> get_partuuid_from_harddrive_device_path(variable_cursor& var)
+{
+    partition_query query;
+    auto partition_number = read_le32(var);
+    query.partno = partition_number;
+    query.start_lba = read_le64(var); // partition_start
+    query.size_lba = read_le64(var); // partition_size
+
+    uint8_t signature[16];
+    read(var, signature, sizeof(signature));
+    read<uint8_t>(var); // mbrtype
+    auto signaturetype = read<uint8_t>(var);
+    if (signaturetype == 1/*mbr*/) {
+        uint32_t disk_signature;
+        memcpy(&disk_signature, signature, sizeof(disk_signature));
+        query.id = partition_id::mbr(le32toh(disk_signature), partition_number);
+    } else if (signaturetype == 2/*gpt*/) {
+        query.id = partition_id::gpt(Guid::from_efi_bytes(signature));
+    } else {
+        return {};
+    }
+    query.partuuid = query.id.to_string();
+    return query;
+}
+
+// PARTUUID of the ESP the loader was started from, set by systemd-boot and other boot loaders
+// implementing the Boot Loader Interface(UTF-16 string)
+static std::optional<std::string> get_loader_device_partuuid(const efivar_source& efivars)
+{
+    auto contents = efivars.read("LoaderDevicePartUUID-4a67b082-0a4c-41cf-b6c7-440b29bb8c4f");
+    if (!contents) return {};
+    //else
+    variable_cursor var { std::move(*contents) };
+    read_le32(var); // variable attributes
+    std::string partuuid;
+    for (int i = 0; i < 36; i++) partuuid += (char)tolower(read_le16(var) & 0xff);
+    return partuuid;
+}
+
+// Boot#### variable of the current boot option
+static variable_cursor read_current_boot_option(const efivar_source& efivars)
+{
+    uint16_t boot_current = [&efivars]() {
+        if (auto contents = efivars.read("BootCurrent-8be4df61-93ca-11d2-aa0d-00e098032b8c")) {
+            variable_cursor var { std::move(*contents) };
+            read_le32(var); // variable attributes
+            auto boot_current = read_le16(var); // current boot #
+            metrics.boot_current = boot_current;
+            return boot_current;
+        }
+        //else
+        // a running firmware without BootCurrent gives nothing to go by
+        if (efivars.has_volatile_variables()) throw detection_error(failure_reason::no_efivars, "Cannot access EFI vars(No efivarfs mounted?)"); // no efi firmware?
+        //else
+        // a VM's variable store(--ovmf-vars) keeps no BootCurrent: the option the firmware is going to boot then
+        for (const char* name : { "BootNext-8be4df61-93ca-11d2-aa0d-00e098032b8c", "BootOrder-8be4df61-93ca-11d2-aa0d-00e098032b8c" }) {
+            auto contents = efivars.read(name);
+            if (!contents || contents->size() < 4 + 2) continue;
+            //else
+            variable_cursor var { std::move(*contents) };
+            read_le32(var); // variable attributes
+            trace("no BootCurrent, taking the first boot option of ", name);
+            return read_le16(var);
+        }
+        //else
+        throw detection_error(failure_reason::no_boot_option, "Neither BootNext nor BootOrder in the variable store");
+    }();
+
+    char bootvar[80];
+    if (sprintf(bootvar, "Boot%04X-8be4df61-93ca-11d2-aa0d-00e098032b8c", boot_current) < 0) {
+        throw std::runtime_error("sprintf() failed(how come this could happen?)");
+    }
+    //else
+    auto contents = efivars.read(bootvar);
+    if (!contents) throw detection_error(failure_reason::no_boot_option, "Cannot access EFI boot option " + std::to_string(boot_current));
+    return variable_cursor { std::move(*contents) };
+}
+
+partition_query boot_partition_query(const efivar_source& efivars, std::string* loader_path)
+{
+    std::optional<phase_timer> timer;
+    timer.emplace("efivars");
+    auto var = read_current_boot_option(efivars);
+
+    timer.emplace("device_path");
+    read_le32(var); // variable attributes
+    read_le32(var); // some flags
+    read_le16(var); // length of path list
+    while (read_le16(var) != 0x0000) { ; } // description
+
+    std::optional<partition_query> query;
+    // the FILEPATH node(s) following the HD node: the loader, relative to the root of the ESP
+    char path[PATH_MAX];
+    size_t path_len = 0;
+    bool has_path = false;
+    // parse device tree until what we're looking for found(and the path after it, when asked for)
+    while (!query || loader_path) {
+        uint8_t type, subtype;
+        type = read<uint8_t>(var);
+        subtype = read<uint8_t>(var);
+        if (type == 0x7f/*END_DEVICE_PATH_TYPE*/ && subtype == 0xff/*END_ENTIRE_DEVICE_PATH_SUBTYPE*/)
+            break; // reached to the end of device path
+        // else
+        auto struct_len = read_le16(var);
+        if (struct_len < 4) throw detection_error(failure_reason::invalid_device_path, "Invalid structure(length must not be less than 4)");
+        ssize_t data_len = struct_len - 4;
+        if (type == 0x04/*MEDIA_DEVICE_PATH*/ && subtype == 0x01/*MEDIA_HARDDRIVE_DP*/ && !query) {
+            query = get_partuuid_from_harddrive_device_path(var);
+            continue;
+        }
+        //else
+        uint8_t buf[data_len];
+        read(var, buf, data_len);
+        if (type != 0x04/*MEDIA_DEVICE_PATH*/ || subtype != 0x04/*MEDIA_FILEPATH_DP*/ || !query) continue; // skip this part
+        //else
+        // a path may be split over consecutive nodes
+        if (path_len > 0 && path_len + 2 < sizeof(path) && path[path_len - 1] != '\\' && data_len >= 2 && buf[0] != '\\') {
+            path[path_len++] = '\\';
+        }
+        auto decoded = utf16le_to_utf8(buf, data_len, path + path_len, sizeof(path) - path_len - 1);
+        if (!decoded) throw detection_error(failure_reason::invalid_device_path, "Malformed file path in boot option");
+        //else
+        path_len += *decoded;
+        has_path = true;
+    }
+    if (loader_path && has_path) {
+        std::replace(path, path + path_len, '\\', '/');
+        *loader_path = std::string(path, path_len);
+    }
+    if (!query) {
+        // e.g. the boot option points to a loader on another device, which then chainloaded from the ESP
+        if (auto partuuid = get_loader_device_partuuid(efivars)) {
+            trace("no harddrive node in Boot", metrics.boot_current.load(), ", using LoaderDevicePartUUID");
+            auto id = partition_id::parse(*partuuid);
+            if (!id) throw detection_error(failure_reason::invalid_device_path, "Malformed LoaderDevicePartUUID: " + *partuuid);
+            //else
+            query = partition_query { *id, id->to_string(), 0, 0, 0 };
+        }
+    }
+    if (!query) throw detection_error(failure_reason::no_harddrive_node, "Partition not found in device path");
+    //else
+    return *query;
+}
+
+std::string describe_boot_option(const efivar_source& efivars)
+{
+    phase_timer timer("efivars");
+    auto var = read_current_boot_option(efivars);
+    const uint8_t* buf = var.contents.data();
+    auto r = var.contents.size();
+    if (r < 4 + 6) throw detection_error(failure_reason::truncated_variable, "Boot option too short");
+    //else
+    // variable attributes, EFI_LOAD_OPTION: attributes, length of path list, description(UTF-16), path list
+    const uint8_t* p = buf + 4 + 4;
+    size_t path_list_len = p[0] | p[1] << 8;
+    p += 2;
+    while (p + 1 < buf + r && (p[0] || p[1])) p += 2;
+    p += 2;
+    if (p > buf + r || path_list_len > (size_t)(buf + r - p)) {
+        throw detection_error(failure_reason::truncated_variable, "Boundary exceeded(EFI bug?)");
+    }
+    //else
+    return device_path_text(p, path_list_len);
+}
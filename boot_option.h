@@ -0,0 +1,25 @@
+/*
+ * detect_efi_boot_partition
+ *  Reading the current boot option out of EFI variables
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __BOOT_OPTION_H__
+#define __BOOT_OPTION_H__
+
+#include <string>
+
+#include "efivars.h"
+#include "resolver.h"
+
+// The current boot option is Boot#### of BootCurrent, or of BootNext or the first of BootOrder in a variable
+// store, which can't keep BootCurrent(--ovmf-vars). Safe to call from several threads with sources of their own.
+
+// the partition firmware booted from, as the current boot option's device path tells;
+// with loader_path, also the loader file on it(empty when the boot option names none)
+partition_query boot_partition_query(const efivar_source& efivars, std::string* loader_path = nullptr);
+
+// the current boot option's whole device path in UEFI text form
+std::string describe_boot_option(const efivar_source& efivars);
+
+#endif // __BOOT_OPTION_H__
@@ -0,0 +1,526 @@
+/*
+ * detect_efi_boot_partition
+ *  gzip, xz and zstd compressed raw disk images(--image)
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <lzma.h>
+#include <zstd.h>
+
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+#include "compressed_image.h"
+#include "disk_image.h"
+#include "metrics.h"
+
+static const size_t prefix_max = 1024 * 1024;   // kept from the start of the image
+static const size_t window_max = 1024 * 1024;   // kept behind the decoder
+static const size_t chunk_size = 128 * 1024;    // decompressed at a time
+static const size_t input_size = 64 * 1024;     // compressed bytes read at a time
+
+static const uint8_t gzip_magic[2] = { 0x1f, 0x8b };
+static const uint8_t xz_magic[6] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+static const uint8_t zstd_magic[4] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+compressed_image_reader::compressed_image_reader(const std::filesystem::path& path) : path_(path)
+{
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("Cannot open " + path.string() + ": " + strerror(errno));
+    //else
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        throw std::runtime_error(path.string() + " is not a regular file");
+    }
+    //else
+    file_size_ = st.st_size;
+}
+
+compressed_image_reader::~compressed_image_reader()
+{
+    ::close(fd);
+}
+
+void compressed_image_reader::read_file(void* buf, size_t size, uint64_t offset) const
+{
+    auto r = ::pread(fd, buf, size, offset);
+    if (r < (ssize_t)size) throw std::runtime_error("Short read from " + path_.string());
+}
+
+// decompresses the next chunk on the way to offset, restarting the decoder at the entry point covering offset
+// if it is past offset or short of that entry point
+void compressed_image_reader::decompress_towards(uint64_t offset)
+{
+    auto entry = std::upper_bound(entry_points_.begin(), entry_points_.end(), offset,
+        [](uint64_t offset, const entry_point& e) { return offset < e.offset; }) - entry_points_.begin() - 1;
+    if (!entry_ || *entry_ != (size_t)entry || pos_ > offset) {
+        if (entry_ && pos_ > offset) trace(path_.string(), ": decompressing again from offset ", entry_points_[entry].offset);
+        entry_.reset();
+        start(entry);
+        entry_ = entry;
+        pos_ = entry_points_[entry].offset;
+        window_.clear();
+    }
+    if (window_.size() + chunk_size > window_max) window_.erase(window_.begin(), window_.end() - (window_max - chunk_size));
+    auto old_size = window_.size();
+    window_.resize(old_size + chunk_size);
+    size_t n;
+    try {
+        n = decompress(window_.data() + old_size, chunk_size);
+    }
+    catch (...) {
+        entry_.reset();
+        throw;
+    }
+    window_.resize(old_size + n);
+    if (n == 0) {
+        entry_.reset();
+        throw std::runtime_error(path_.string() + ": compressed data ends before the image does");
+    }
+    //else
+    if (pos_ == prefix_.size() && pos_ < prefix_max) {
+        prefix_.insert(prefix_.end(), window_.begin() + old_size, window_.begin() + old_size + std::min<uint64_t>(n, prefix_max - pos_));
+    }
+    pos_ += n;
+}
+
+void compressed_image_reader::pread(void* buf, size_t size, uint64_t offset)
+{
+    if (offset > size_ || size > size_ - offset) throw std::runtime_error("Read beyond end of image");
+    //else
+    auto p = (uint8_t*)buf;
+    while (size > 0) {
+        const uint8_t* src = nullptr;
+        uint64_t available = 0;
+        auto window_start = pos_ - window_.size();
+        if (offset < prefix_.size()) {
+            src = prefix_.data() + offset;
+            available = prefix_.size() - offset;
+        } else if (entry_ && offset >= window_start && offset < pos_) {
+            src = window_.data() + (offset - window_start);
+            available = pos_ - offset;
+        }
+        if (!src) {
+            decompress_towards(offset);
+            continue;
+        }
+        //else
+        auto n = std::min<uint64_t>(size, available);
+        memcpy(p, src, n);
+        p += n;
+        offset += n;
+        size -= n;
+    }
+}
+
+// gzip(RFC 1952): one entry point, the start of the file
+class gzip_image_reader : public compressed_image_reader {
+    z_stream z_ = {};
+    bool initialized_ = false;
+    std::vector<uint8_t> in_;
+    uint64_t file_pos_ = 0;
+    uint64_t guess_size(uint32_t isize);
+protected:
+    void start(size_t entry) override;
+    size_t decompress(uint8_t* buf, size_t size) override;
+public:
+    explicit gzip_image_reader(const std::filesystem::path& path);
+    ~gzip_image_reader() override;
+};
+
+gzip_image_reader::gzip_image_reader(const std::filesystem::path& path) : compressed_image_reader(path), in_(input_size)
+{
+    if (file_size_ < 18) throw std::runtime_error(path.string() + ": truncated gzip file");
+    //else
+    entry_points_.push_back({ 0, 0 });
+    uint32_t isize;
+    read_file(&isize, sizeof(isize), file_size_ - sizeof(isize));
+    size_ = guess_size(le32toh(isize));
+    sector_size_ = probe_image_sector_size(*this);
+}
+
+gzip_image_reader::~gzip_image_reader()
+{
+    if (initialized_) inflateEnd(&z_);
+}
+
+// The trailer has the size modulo 4GiB only. Take the smallest size agreeing with it that holds what the MBR
+// (protective on GPT disks, covering the whole disk) and the GPT header(where the backup is) say is on the disk.
+uint64_t gzip_image_reader::guess_size(uint32_t isize)
+{
+    size_ = std::numeric_limits<uint64_t>::max();   // while peeking at the first sectors
+    uint8_t mbr[512], gpt_512[40], gpt_4096[40] = {};
+    try {
+        pread(mbr, sizeof(mbr), 0);
+        pread(gpt_512, sizeof(gpt_512), 512);
+    }
+    catch (const std::runtime_error&) {
+        return isize;   // shorter than that: the trailer says it all
+    }
+    try {
+        pread(gpt_4096, sizeof(gpt_4096), 4096);
+    }
+    catch (const std::runtime_error&) {
+        // no room for a 4Kn GPT header
+    }
+    bool large_sector = memcmp(gpt_512, "EFI PART", 8) != 0 && memcmp(gpt_4096, "EFI PART", 8) == 0;
+    uint64_t sector_size = large_sector? 4096 : 512;
+    const uint8_t* gpt = large_sector? gpt_4096 : gpt_512;
+    uint64_t needed = 0;
+    if (mbr[510] == 0x55 && mbr[511] == 0xaa) {
+        for (int i = 0; i < 4; i++) {
+            uint32_t lba_start, lba_count;
+            memcpy(&lba_start, mbr + 446 + i * 16 + 8, sizeof(lba_start));
+            memcpy(&lba_count, mbr + 446 + i * 16 + 12, sizeof(lba_count));
+            needed = std::max(needed, ((uint64_t)le32toh(lba_start) + le32toh(lba_count)) * sector_size);
+        }
+    }
+    if (memcmp(gpt, "EFI PART", 8) == 0) {
+        uint64_t alternate_lba;
+        memcpy(&alternate_lba, gpt + 32, sizeof(alternate_lba));
+        needed = std::max(needed, (le64toh(alternate_lba) + 1) * sector_size);
+    }
+    uint64_t size = isize;
+    while (size < needed) size += 1ULL << 32;
+    if (size != isize) trace(path_.string(), ": taking the image size as ", size, " bytes from the partition table and the gzip trailer");
+    return size;
+}
+
+void gzip_image_reader::start(size_t entry)
+{
+    auto rst = initialized_? inflateReset(&z_) : inflateInit2(&z_, 16 + MAX_WBITS/*gzip header*/);
+    if (rst != Z_OK) throw std::runtime_error("inflateInit2() failed");
+    //else
+    initialized_ = true;
+    file_pos_ = entry_points_[entry].file_offset;
+    z_.avail_in = 0;
+}
+
+size_t gzip_image_reader::decompress(uint8_t* buf, size_t size)
+{
+    z_.next_out = buf;
+    z_.avail_out = size;
+    while (z_.avail_out > 0) {
+        if (z_.avail_in == 0) {
+            auto r = ::pread(fd, in_.data(), in_.size(), file_pos_);
+            if (r < 0) throw std::runtime_error("Cannot read " + path_.string() + ": " + strerror(errno));
+            //else
+            if (r == 0) break;
+            //else
+            file_pos_ += r;
+            z_.next_in = in_.data();
+            z_.avail_in = r;
+        }
+        auto rst = inflate(&z_, Z_NO_FLUSH);
+        if (rst == Z_STREAM_END) {
+            // members concatenated(pigz and the like) make one image
+            if (inflateReset(&z_) != Z_OK) throw std::runtime_error("inflateReset() failed");
+            continue;
+        }
+        //else
+        if (rst != Z_OK && rst != Z_BUF_ERROR) throw std::runtime_error(path_.string() + ": corrupt gzip data");
+    }
+    return size - z_.avail_out;
+}
+
+// xz: the index at the end of each stream lists the blocks, each of which can be decoded on its own
+class xz_image_reader : public compressed_image_reader {
+    struct block_t {
+        uint64_t unpadded_size;
+        lzma_check check;
+    };
+    std::vector<block_t> blocks_;   // of entry_points_
+    lzma_stream strm_ = LZMA_STREAM_INIT;
+    lzma_block block_;      // the decoder refers to it until the end of the block
+    lzma_filter filters_[LZMA_FILTERS_MAX + 1];
+    std::vector<uint8_t> in_;
+    uint64_t file_pos_ = 0;
+    bool block_end_ = false;
+    lzma_index* read_index();
+protected:
+    void start(size_t entry) override;
+    size_t decompress(uint8_t* buf, size_t size) override;
+public:
+    explicit xz_image_reader(const std::filesystem::path& path);
+    ~xz_image_reader() override;
+};
+
+xz_image_reader::xz_image_reader(const std::filesystem::path& path) : compressed_image_reader(path), in_(input_size)
+{
+    auto index = read_index();
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, index);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK)) {
+        entry_points_.push_back({ iter.block.uncompressed_file_offset, iter.block.compressed_file_offset });
+        blocks_.push_back({ iter.block.unpadded_size, iter.stream.flags->check });
+    }
+    size_ = lzma_index_uncompressed_size(index);
+    lzma_index_end(index, nullptr);
+    if (entry_points_.empty()) entry_points_.push_back({ 0, 0 });
+    trace(path.string(), ": ", blocks_.size(), " xz blocks");
+    sector_size_ = probe_image_sector_size(*this);
+}
+
+xz_image_reader::~xz_image_reader()
+{
+    lzma_end(&strm_);
+}
+
+// the indexes of all the streams in the file, from the last one backwards
+lzma_index* xz_image_reader::read_index()
+{
+    lzma_index* combined = nullptr;
+    try {
+        uint64_t pos = file_size_;
+        while (pos > 0) {
+            // stream padding: multiples of 4 null bytes
+            uint64_t padding = 0;
+            uint32_t word = 0;
+            while (pos >= 4) {
+                read_file(&word, sizeof(word), pos - 4);
+                if (word != 0) break;
+                //else
+                pos -= 4;
+                padding += 4;
+            }
+            if (pos < LZMA_STREAM_HEADER_SIZE * 2) throw std::runtime_error(path_.string() + ": truncated xz file");
+            //else
+            uint8_t footer[LZMA_STREAM_HEADER_SIZE];
+            read_file(footer, sizeof(footer), pos - LZMA_STREAM_HEADER_SIZE);
+            lzma_stream_flags footer_flags;
+            if (lzma_stream_footer_decode(&footer_flags, footer) != LZMA_OK) throw std::runtime_error(path_.string() + ": bad xz stream footer");
+            //else
+            auto index_end = pos - LZMA_STREAM_HEADER_SIZE;
+            if (footer_flags.backward_size > index_end - LZMA_STREAM_HEADER_SIZE) throw std::runtime_error(path_.string() + ": bad xz index size");
+            //else
+            std::vector<uint8_t> buf(footer_flags.backward_size);
+            read_file(buf.data(), buf.size(), index_end - buf.size());
+            lzma_index* index = nullptr;
+            uint64_t memlimit = UINT64_MAX;
+            size_t in_pos = 0;
+            if (lzma_index_buffer_decode(&index, &memlimit, nullptr, buf.data(), &in_pos, buf.size()) != LZMA_OK) {
+                throw std::runtime_error(path_.string() + ": bad xz index");
+            }
+            //else
+            // the stream header is where the index says the stream starts
+            auto stream_size = lzma_index_stream_size(index);
+            uint8_t header[LZMA_STREAM_HEADER_SIZE];
+            lzma_stream_flags header_flags;
+            bool ok = stream_size <= pos;
+            if (ok) {
+                read_file(header, sizeof(header), pos - stream_size);
+                ok = lzma_stream_header_decode(&header_flags, header) == LZMA_OK
+                    && lzma_stream_flags_compare(&header_flags, &footer_flags) == LZMA_OK
+                    && lzma_index_stream_flags(index, &footer_flags) == LZMA_OK
+                    && lzma_index_stream_padding(index, padding) == LZMA_OK
+                    && (!combined || lzma_index_cat(index, combined, nullptr) == LZMA_OK);
+            }
+            if (!ok) {
+                lzma_index_end(index, nullptr);
+                throw std::runtime_error(path_.string() + ": bad xz stream");
+            }
+            //else
+            combined = index;   // took in the streams after this one
+            pos -= stream_size;
+        }
+    }
+    catch (...) {
+        if (combined) lzma_index_end(combined, nullptr);
+        throw;
+    }
+    if (!combined) throw std::runtime_error(path_.string() + ": empty xz file");
+    //else
+    return combined;
+}
+
+void xz_image_reader::start(size_t entry)
+{
+    if (blocks_.empty()) throw std::runtime_error(path_.string() + ": no data in the xz file");
+    //else
+    auto file_offset = entry_points_[entry].file_offset;
+    uint8_t header[LZMA_BLOCK_HEADER_SIZE_MAX];
+    read_file(header, 1, file_offset);
+    block_ = {};
+    block_.version = 1;
+    block_.check = blocks_[entry].check;
+    block_.filters = filters_;
+    block_.header_size = lzma_block_header_size_decode(header[0]);
+    if (header[0] == 0) throw std::runtime_error(path_.string() + ": bad xz block header");
+    //else
+    read_file(header + 1, block_.header_size - 1, file_offset + 1);
+    if (lzma_block_header_decode(&block_, nullptr, header) != LZMA_OK) throw std::runtime_error(path_.string() + ": bad xz block header");
+    //else
+    auto rst = lzma_block_compressed_size(&block_, blocks_[entry].unpadded_size);
+    if (rst == LZMA_OK) rst = lzma_block_decoder(&strm_, &block_);
+    for (size_t i = 0; filters_[i].id != LZMA_VLI_UNKNOWN; i++) {
+        free(filters_[i].options);  // copied by the decoder
+        filters_[i].options = nullptr;
+    }
+    if (rst != LZMA_OK) throw std::runtime_error(path_.string() + ": cannot decode xz block(" + std::to_string(rst) + ")");
+    //else
+    file_pos_ = file_offset + block_.header_size;
+    strm_.avail_in = 0;
+    block_end_ = false;
+}
+
+size_t xz_image_reader::decompress(uint8_t* buf, size_t size)
+{
+    strm_.next_out = buf;
+    strm_.avail_out = size;
+    while (strm_.avail_out > 0 && !block_end_) {
+        if (strm_.avail_in == 0) {
+            auto r = ::pread(fd, in_.data(), in_.size(), file_pos_);
+            if (r < 0) throw std::runtime_error("Cannot read " + path_.string() + ": " + strerror(errno));
+            //else
+            if (r == 0) throw std::runtime_error(path_.string() + ": truncated xz block");
+            //else
+            file_pos_ += r;
+            strm_.next_in = in_.data();
+            strm_.avail_in = r;
+        }
+        auto rst = lzma_code(&strm_, LZMA_RUN);
+        if (rst == LZMA_STREAM_END) block_end_ = true;
+        else if (rst != LZMA_OK) throw std::runtime_error(path_.string() + ": corrupt xz data(" + std::to_string(rst) + ")");
+    }
+    return size - strm_.avail_out;
+}
+
+// zstd: frames of the seekable format(contrib/seekable_format in the zstd tree) are entry points, listed
+// in a seek table at the end; any other file is taken to be one frame which records its decompressed size
+class zstd_image_reader : public compressed_image_reader {
+    ZSTD_DCtx* dctx_ = nullptr;
+    std::vector<uint8_t> in_;
+    size_t in_pos_ = 0, in_size_ = 0;
+    uint64_t file_pos_ = 0;
+    bool read_seek_table();
+protected:
+    void start(size_t entry) override;
+    size_t decompress(uint8_t* buf, size_t size) override;
+public:
+    explicit zstd_image_reader(const std::filesystem::path& path);
+    ~zstd_image_reader() override;
+};
+
+static const uint32_t zstd_skippable_magic = 0x184d2a5e;
+static const uint32_t zstd_seekable_magic = 0x8f92eab1;
+static const size_t zstd_frame_header_max = 18;
+
+zstd_image_reader::zstd_image_reader(const std::filesystem::path& path) : compressed_image_reader(path), in_(input_size)
+{
+    dctx_ = ZSTD_createDCtx();
+    if (!dctx_) throw std::runtime_error("ZSTD_createDCtx() failed");
+    //else
+    if (read_seek_table()) {
+        trace(path.string(), ": zstd seekable format, ", entry_points_.size(), " frames");
+    } else {
+        uint8_t header[zstd_frame_header_max];
+        auto r = ::pread(fd, header, sizeof(header), 0);
+        auto content_size = ZSTD_getFrameContentSize(header, r > 0? r : 0);
+        if (content_size == ZSTD_CONTENTSIZE_UNKNOWN) {
+            throw std::runtime_error(path.string() + ": zstd frame doesn't record the image size(compressed from a pipe?)");
+        }
+        //else
+        if (content_size == ZSTD_CONTENTSIZE_ERROR) throw std::runtime_error(path.string() + ": bad zstd frame header");
+        //else
+        entry_points_.push_back({ 0, 0 });
+        size_ = content_size;
+    }
+    sector_size_ = probe_image_sector_size(*this);
+}
+
+zstd_image_reader::~zstd_image_reader()
+{
+    ZSTD_freeDCtx(dctx_);
+}
+
+// seek table: a skippable frame ending the file with the compressed and decompressed size of every frame
+bool zstd_image_reader::read_seek_table()
+{
+    struct __attribute__((packed)) {
+        uint32_t frames;
+        uint8_t descriptor;
+        uint32_t magic;
+    } footer;
+    if (file_size_ < 8 + sizeof(footer)) return false;
+    //else
+    read_file(&footer, sizeof(footer), file_size_ - sizeof(footer));
+    if (le32toh(footer.magic) != zstd_seekable_magic || (footer.descriptor & 0x7c)) return false;
+    //else
+    size_t entry_size = footer.descriptor & 0x80/*checksums*/? 12 : 8;
+    uint64_t frames = le32toh(footer.frames);
+    uint64_t table_size = 8 + frames * entry_size + sizeof(footer);
+    if (table_size > file_size_) return false;
+    //else
+    std::vector<uint8_t> table(table_size - sizeof(footer));
+    read_file(table.data(), table.size(), file_size_ - table_size);
+    uint32_t magic, frame_size;
+    memcpy(&magic, table.data(), sizeof(magic));
+    memcpy(&frame_size, table.data() + 4, sizeof(frame_size));
+    if (le32toh(magic) != zstd_skippable_magic || le32toh(frame_size) != table_size - 8) return false;
+    //else
+    uint64_t offset = 0, file_offset = 0;
+    for (uint64_t i = 0; i < frames; i++) {
+        uint32_t compressed, decompressed;
+        memcpy(&compressed, table.data() + 8 + i * entry_size, sizeof(compressed));
+        memcpy(&decompressed, table.data() + 8 + i * entry_size + 4, sizeof(decompressed));
+        entry_points_.push_back({ offset, file_offset });
+        offset += le32toh(decompressed);
+        file_offset += le32toh(compressed);
+    }
+    if (file_offset > file_size_ - table_size) throw std::runtime_error(path_.string() + ": bad zstd seek table");
+    //else
+    if (entry_points_.empty()) entry_points_.push_back({ 0, 0 });
+    size_ = offset;
+    return true;
+}
+
+void zstd_image_reader::start(size_t entry)
+{
+    ZSTD_DCtx_reset(dctx_, ZSTD_reset_session_only);
+    file_pos_ = entry_points_[entry].file_offset;
+    in_pos_ = in_size_ = 0;
+}
+
+size_t zstd_image_reader::decompress(uint8_t* buf, size_t size)
+{
+    ZSTD_outBuffer out = { buf, size, 0 };
+    while (out.pos < out.size) {
+        if (in_pos_ == in_size_) {
+            auto r = ::pread(fd, in_.data(), in_.size(), file_pos_);
+            if (r < 0) throw std::runtime_error("Cannot read " + path_.string() + ": " + strerror(errno));
+            //else
+            if (r == 0) break;
+            //else
+            file_pos_ += r;
+            in_pos_ = 0;
+            in_size_ = r;
+        }
+        ZSTD_inBuffer in = { in_.data(), in_size_, in_pos_ };
+        auto rst = ZSTD_decompressStream(dctx_, &out, &in);    // frames after the first, if any, follow on
+        in_pos_ = in.pos;
+        if (ZSTD_isError(rst)) throw std::runtime_error(path_.string() + ": corrupt zstd data(" + ZSTD_getErrorName(rst) + ")");
+    }
+    return out.pos;
+}
+
+std::unique_ptr<block_reader> compressed_image_reader::open(const std::filesystem::path& path, const uint8_t* magic)
+{
+    if (memcmp(magic, gzip_magic, sizeof(gzip_magic)) == 0) return std::make_unique<gzip_image_reader>(path);
+    //else
+    if (memcmp(magic, xz_magic, sizeof(xz_magic)) == 0) return std::make_unique<xz_image_reader>(path);
+    //else
+    if (memcmp(magic, zstd_magic, sizeof(zstd_magic)) == 0) return std::make_unique<zstd_image_reader>(path);
+    //else
+    return nullptr;
+}
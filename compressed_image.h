@@ -0,0 +1,63 @@
+/*
+ * detect_efi_boot_partition
+ *  gzip, xz and zstd compressed raw disk images(--image)
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __COMPRESSED_IMAGE_H__
+#define __COMPRESSED_IMAGE_H__
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+#include <optional>
+#include <filesystem>
+
+#include "partition_table.h"
+
+// A raw image compressed as a whole, decompressed only as far as reads reach. The first MiB, where partition
+// tables live, is kept once decompressed; other reads decompress forward from the closest point decoding can
+// start at(the start of the file, an xz block or a frame of the zstd seekable format), and the last MiB decoded
+// is kept for reads close behind. So a partition table costs a few hundred KiB of decompression, and only a
+// damaged primary GPT(backup read at the end) may cost decompressing up to the end of an xz block or the file.
+class compressed_image_reader : public block_reader {
+protected:
+    struct entry_point {
+        uint64_t offset;        // in the decompressed image
+        uint64_t file_offset;   // where its compressed data starts
+    };
+    std::filesystem::path path_;
+    int fd = -1;
+    uint64_t file_size_ = 0;
+    uint64_t size_ = 0;
+    unsigned int sector_size_ = 512;
+    std::vector<entry_point> entry_points_;     // ascending, the first at offset 0
+
+    explicit compressed_image_reader(const std::filesystem::path& path);
+    void read_file(void* buf, size_t size, uint64_t offset) const;
+    // (re)starts the decoder at entry_points_[entry]
+    virtual void start(size_t entry) = 0;
+    // up to size bytes following those decompressed last, 0 at the end of the data
+    virtual size_t decompress(uint8_t* buf, size_t size) = 0;
+private:
+    std::vector<uint8_t> prefix_;   // the image from offset 0
+    std::vector<uint8_t> window_;   // the last bytes decompressed, up to pos_
+    uint64_t pos_ = 0;              // of the next byte the decoder yields
+    std::optional<size_t> entry_;   // where the decoder was started; nullopt: not started(or failed)
+    void decompress_towards(uint64_t offset);
+public:
+    ~compressed_image_reader() override;
+    compressed_image_reader(const compressed_image_reader&) = delete;
+    compressed_image_reader& operator=(const compressed_image_reader&) = delete;
+
+    void pread(void* buf, size_t size, uint64_t offset) override;
+    uint64_t size() const override { return size_; }
+    unsigned int sector_size() const override { return sector_size_; }
+
+    // a reader for the gzip, xz or zstd file magic(the first 6 bytes of the file) says it is, nullptr if none of them;
+    // throws when the file can't be used
+    static std::unique_ptr<block_reader> open(const std::filesystem::path& path, const uint8_t* magic);
+};
+
+#endif // __COMPRESSED_IMAGE_H__
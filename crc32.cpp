@@ -0,0 +1,161 @@
+/*
+ * detect_efi_boot_partition
+ *  CRC-32 for GPT validation
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <endian.h>
+#include <string.h>
+
+#include <array>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_PCLMUL
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32_ARMV8
+#endif
+
+#include "crc32.h"
+
+typedef std::array<std::array<uint32_t, 256>, 8> slice8_tables_t;
+
+static constexpr slice8_tables_t make_slice8_tables()
+{
+    slice8_tables_t tables {};
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        tables[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int slice = 1; slice < 8; slice++) {
+            tables[slice][i] = (tables[slice - 1][i] >> 8) ^ tables[0][tables[slice - 1][i] & 0xff];
+        }
+    }
+    return tables;
+}
+
+static constexpr slice8_tables_t slice8_tables = make_slice8_tables();
+
+// works on the non-inverted register
+static uint32_t slice8(const uint8_t* p, size_t len, uint32_t crc)
+{
+    const auto& t = slice8_tables;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo = le32toh(lo) ^ crc;
+        hi = le32toh(hi);
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+            ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    }
+    while (len--) crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+uint32_t crc32_ieee_slice8(const void* buf, size_t len, uint32_t crc)
+{
+    return ~slice8((const uint8_t*)buf, len, ~crc);
+}
+
+#if defined(CRC32_PCLMUL)
+// one folding step: x carried 128 bits forward(multiplied by the constants k) plus the next data
+__attribute__((target("pclmul,sse4.1")))
+static inline __m128i fold(__m128i x, __m128i k, __m128i data)
+{
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)), data);
+}
+
+// Carry-less multiplication folding("Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+// Instruction", Intel 2009): four 128 bit lanes folded 64 bytes at a time, then down to 128 bits
+// and Barrett-reduced to 32. len must be a multiple of 16 and at least 64; non-inverted register.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t pclmul(const uint8_t* p, size_t len, uint32_t crc)
+{
+    // constants of the bit-reflected domain
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    p += 64;
+    len -= 64;
+
+    for (; len >= 64; p += 64, len -= 64) {
+        x1 = fold(x1, k1k2, _mm_loadu_si128((const __m128i*)(p + 0x00)));
+        x2 = fold(x2, k1k2, _mm_loadu_si128((const __m128i*)(p + 0x10)));
+        x3 = fold(x3, k1k2, _mm_loadu_si128((const __m128i*)(p + 0x20)));
+        x4 = fold(x4, k1k2, _mm_loadu_si128((const __m128i*)(p + 0x30)));
+    }
+
+    // four lanes into one
+    x1 = fold(x1, k3k4, x2);
+    x1 = fold(x1, k3k4, x3);
+    x1 = fold(x1, k3k4, x4);
+    for (; len >= 16; p += 16, len -= 16) {
+        x1 = fold(x1, k3k4, _mm_loadu_si128((const __m128i*)p));
+    }
+
+    // 128 -> 64 bits
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), _mm_clmulepi64_si128(x1, k3k4, 0x10));
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5k0, 0x00), _mm_srli_si128(x1, 4));
+
+    // Barrett reduction to 32 bits
+    __m128i x2b = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+    x2b = _mm_clmulepi64_si128(_mm_and_si128(x2b, mask32), poly, 0x00);
+    return _mm_extract_epi32(_mm_xor_si128(x1, x2b), 1);
+}
+
+static const bool has_pclmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+
+uint32_t crc32_ieee(const void* buf, size_t len, uint32_t crc)
+{
+    auto p = (const uint8_t*)buf;
+    crc = ~crc;
+    if (has_pclmul && len >= 64) {
+        size_t bulk = len & ~(size_t)15;
+        crc = pclmul(p, bulk, crc);
+        p += bulk;
+        len -= bulk;
+    }
+    return ~slice8(p, len, crc);
+}
+
+const char* crc32_ieee_impl() { return has_pclmul? "pclmul" : "slice-by-8"; }
+
+#elif defined(CRC32_ARMV8)
+// the ARMv8 CRC32 instructions compute exactly this polynomial, 8 bytes per instruction;
+// no need for PMULL folding at the sizes of GPT entry arrays
+uint32_t crc32_ieee(const void* buf, size_t len, uint32_t crc)
+{
+    auto p = (const uint8_t*)buf;
+    crc = ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32d(crc, le64toh(v));
+    }
+    while (len--) crc = __crc32b(crc, *p++);
+    return ~crc;
+}
+
+const char* crc32_ieee_impl() { return "armv8-crc32"; }
+
+#else
+uint32_t crc32_ieee(const void* buf, size_t len, uint32_t crc)
+{
+    return crc32_ieee_slice8(buf, len, crc);
+}
+
+const char* crc32_ieee_impl() { return "slice-by-8"; }
+#endif
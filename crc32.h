@@ -0,0 +1,23 @@
+/*
+ * detect_efi_boot_partition
+ *  CRC-32 for GPT validation
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __CRC32_H__
+#define __CRC32_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC-32 of GPT headers and entry arrays(same as zlib's crc32()); chains like it:
+// crc32_ieee(b, len_b, crc32_ieee(a, len_a)) == crc32_ieee(ab, len_a + len_b)
+uint32_t crc32_ieee(const void* buf, size_t len, uint32_t crc = 0);
+
+// the portable implementation alone, for comparison
+uint32_t crc32_ieee_slice8(const void* buf, size_t len, uint32_t crc = 0);
+
+// name of the implementation crc32_ieee() dispatches to on this CPU
+const char* crc32_ieee_impl();
+
+#endif // __CRC32_H__
@@ -0,0 +1,54 @@
+/*
+ * detect_efi_boot_partition
+ *  CRC-32 throughput against zlib's crc32()
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <zlib.h>
+
+#include <chrono>
+#include <random>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+
+#include "crc32.h"
+
+template <typename F> static double seconds_per_call(F f, size_t len)
+{
+    // enough iterations for ~256MiB of data, at least 1000 calls
+    size_t iterations = std::max<size_t>(1000, (256 << 20) / len);
+    volatile uint32_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++) sink = sink + f();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+int main()
+{
+    std::mt19937 rng(0);
+    std::vector<uint8_t> buf(1 << 20);
+    for (auto& b : buf) b = (uint8_t)rng();
+
+    std::cout << "crc32_ieee: " << crc32_ieee_impl() << std::endl;
+    std::cout << std::setw(10) << "bytes" << std::setw(16) << "crc32_ieee" << std::setw(16) << "slice-by-8" << std::setw(16) << "zlib" << std::endl;
+    // GPT header, one sector, the usual 128 x 128 byte entry array, a large one
+    for (size_t len : { (size_t)92, (size_t)512, (size_t)16384, buf.size() }) {
+        auto expected = crc32(0, buf.data(), len);
+        if (crc32_ieee(buf.data(), len) != expected || crc32_ieee_slice8(buf.data(), len) != expected) {
+            std::cerr << "CRC mismatch at " << len << " bytes" << std::endl;
+            return 1;
+        }
+        //else
+        auto ours = seconds_per_call([&]() { return crc32_ieee(buf.data(), len); }, len);
+        auto slice8 = seconds_per_call([&]() { return crc32_ieee_slice8(buf.data(), len); }, len);
+        auto zlib = seconds_per_call([&]() { return (uint32_t)crc32(0, buf.data(), len); }, len);
+        auto gbps = [len](double s) { return len / s / 1e9; };
+        std::cout << std::setw(10) << len << std::fixed << std::setprecision(2)
+            << std::setw(11) << gbps(ours) << " GB/s" << std::setw(11) << gbps(slice8) << " GB/s"
+            << std::setw(11) << gbps(zlib) << " GB/s" << std::endl;
+    }
+    return 0;
+}
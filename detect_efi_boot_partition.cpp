@@ -7,173 +7,143 @@
 
 #include <fcntl.h>
 #include <unistd.h>
-#include <endian.h>
 #include <string.h>
+#include <sys/stat.h>
 
+#include <thread>
+#include <future>
+#include <functional>
+#include <chrono>
+#include <fstream>
 #include <iostream>
+#include <memory>
 #include <optional>
+#include <algorithm>
 #include <filesystem>
 
-#include <blkid/blkid.h>
-
 #include <argparse/argparse.hpp>
 
-static std::optional<std::filesystem::path>
-    search_partition(const std::string& key, const std::string& value)
-{
-    blkid_cache _cache;
-    if (blkid_get_cache(&_cache, "/dev/null") < 0) throw std::runtime_error("blkid_get_cache() failed");
-    auto cache = std::shared_ptr<blkid_struct_cache>(_cache, blkid_put_cache);
-    if (blkid_probe_all(cache.get()) < 0) throw std::runtime_error("blkid_probe_all() failed");
-    std::shared_ptr<blkid_struct_dev_iterate> dev_iter(blkid_dev_iterate_begin(cache.get()),blkid_dev_iterate_end);
-    if (!dev_iter)  throw std::runtime_error("blkid_dev_iterate_begin() failed");
-
-    if (blkid_dev_set_search(dev_iter.get(), key.c_str(), value.c_str()) < 0) 
-        throw std::runtime_error("blkid_dev_set_search() failed");
-    blkid_dev dev = NULL;
-    while (blkid_dev_next(dev_iter.get(), &dev) == 0) {
-        dev = blkid_verify(cache.get(), dev);
-        if (dev) return blkid_dev_devname(dev);
-    }
-    //else
-    return {}; // not found
-}
-
-typedef std::shared_ptr<int> auto_fd;
-
-static auto_fd open(const std::filesystem::path& path, int flags = O_RDONLY)
-{
-    auto_fd fd(
-        new int(::open(path.c_str(), flags)),
-        [](int* fd) {if (fd) { if (*fd >= 0) close(*fd); delete fd; }}
-    );
-    //else
-    return (fd && *fd >= 0)? fd : auto_fd(nullptr);
-}
+#include "metrics.h"
+#include "resolver.h"
+#include "device_reader.h"
+#include "esp_scan.h"
+#include "mountinfo.h"
+#include "efivars.h"
+#include "varstore.h"
+#include "boot_option.h"
+#include "boot_config.h"
+#include "disk_image.h"
+#include "batch.h"
+#include "result_cache.h"
 
-inline void read(auto_fd fd, void* buf, size_t size)
+// boot_partition_query(), recorded for the metrics file and the --deadline report
+static partition_query read_boot_partition_query(const efivar_source& efivars, std::string* loader_path = nullptr)
 {
-    if (!fd) throw std::runtime_error("File descriptor invalid");
-    auto r = ::read(*fd, buf, size);
-    if (r < (ssize_t)size) throw std::runtime_error("Boundary exceeded(EFI bug?)");
+    auto query = boot_partition_query(efivars, loader_path);
+    metrics.partuuid = query.partuuid;
+    metrics.partuuid_known = true;
+    return query;
 }
 
-template <typename T> T read(auto_fd fd)
+static std::filesystem::path detect_efi_boot_partition(const resolver_options& options,
+    const efivar_source& efivars, std::string* loader_path = nullptr)
 {
-    T buf;
-    read(fd, &buf, sizeof(buf));
-    return buf;
+    auto query = read_boot_partition_query(efivars, loader_path);
+    phase_timer timer("search");
+    auto partition = resolve_partition(query, options);
+    if (!partition) throw detection_error(failure_reason::partition_not_found, "Partition not found(PARTUUID=" + query.partuuid + ")");
+    metrics.device = partition->string();
+    return *partition;
 }
 
-inline uint16_t read_le16(auto_fd fd) { return le16toh(read<uint16_t>(fd)); }
-inline uint32_t read_le32(auto_fd fd) { return le32toh(read<uint32_t>(fd)); }
-inline uint64_t read_le64(auto_fd fd) { return le64toh(read<uint64_t>(fd)); }
 
-static std::optional<std::string> get_partuuid_from_harddrive_device_path(auto_fd fd)
+// where the ESP is mounted and the loader's absolute path under it
+static std::pair<std::filesystem::path, std::filesystem::path>
+    locate_loader(const std::filesystem::path& device, const std::string& loader_path)
 {
-    auto partition_number = read_le32(fd);
-    read_le64(fd); // partition_start
-    read_le64(fd); // partition_size
-
-    struct mbr_signature_t {
-        uint32_t u32le;
-        uint8_t padding[12];
-    };
-
-    struct gpt_signature_t {
-        uint32_t u32le;
-        uint16_t u16le1, u16le2, u16be1, u16be2;
-        uint32_t u32be;
-    };
-
-    union signature_t {
-        mbr_signature_t mbr;
-        gpt_signature_t gpt;
-    };
-
-    signature_t signature;
-    static_assert(sizeof(signature) == 16);
-
-    read(fd, &signature, sizeof(signature));
-    read<uint8_t>(fd); // mbrtype
-    auto signaturetype = read<uint8_t>(fd);
-    if (signaturetype == 1/*mbr*/) {
-        char buf[16];
-        if (sprintf(buf, "%08x-%02d", le32toh(signature.mbr.u32le), (int)partition_number) < 0) {
-            throw std::runtime_error("sprintf() failed");
-        }
-        //else
-        return buf;
-    }
+    phase_timer timer("mountinfo");
+    if (loader_path.empty()) throw detection_error(failure_reason::no_loader_path, "Boot option names no loader file");
     //else
-    if (signaturetype == 2/*gpt*/) {
-        char buf[40];
-        if (sprintf(buf, "%08x-%04x-%04x-%04x-%04x%08x", 
-            le32toh(signature.gpt.u32le), le16toh(signature.gpt.u16le1), le16toh(signature.gpt.u16le2),
-            be16toh(signature.gpt.u16be1), be16toh(signature.gpt.u16be2), be32toh(signature.gpt.u32be)) < 0) {
-            throw std::runtime_error("sprintf() failed");
-        }
-        //else
-        return buf;
-    }
+    struct stat st;
+    if (stat(device.c_str(), &st) < 0 || !S_ISBLK(st.st_mode)) throw std::runtime_error("Cannot stat " + device.string());
     //else
-    return {};
-}
-
-static std::filesystem::path detect_efi_boot_partition(
-    const std::filesystem::path& efivars_dir = "/sys/firmware/efi/efivars")
-{
-    uint16_t boot_current = [&efivars_dir]() {
-        auto_fd fd = open(efivars_dir / "BootCurrent-8be4df61-93ca-11d2-aa0d-00e098032b8c");
-        if (!fd) throw std::runtime_error("Cannot access EFI vars(No efivarfs mounted?)"); // no efi firmware?
-        read_le32(fd); // variable attributes
-        return read_le16(fd); // current boot #
-    }();
-
-    char bootvar[80];
-    if (sprintf(bootvar, "Boot%04X-8be4df61-93ca-11d2-aa0d-00e098032b8c", boot_current) < 0) {
-        throw std::runtime_error("sprintf() failed(how come this could happen?)");
-    }
-    //else
-    auto_fd fd = open(efivars_dir / bootvar);
-    if (!fd) throw std::runtime_error("Cannot access EFI boot option " + std::to_string(boot_current));
-
-    read_le32(fd); // variable attributes
-    read_le32(fd); // some flags
-    read_le16(fd); // length of path list
-    while (read_le16(fd) != 0x0000) { ; } // description
-
-    std::optional<std::string> partuuid;
-    while(!partuuid) {  // parse device tree until what we're looking for found
-        uint8_t type, subtype;
-        type = read<uint8_t>(fd);
-        subtype = read<uint8_t>(fd);
-        if (type == 0x7f/*END_DEVICE_PATH_TYPE*/ && subtype == 0xff/*END_ENTIRE_DEVICE_PATH_SUBTYPE*/)
-            break; // reached to the end of device path
-        // else
-        auto struct_len = read_le16(fd);
-        if (struct_len < 4) throw std::runtime_error("Invalid structure(length must not be less than 4)");
-        if (type != 0x04/*MEDIA_DEVICE_PATH*/ || subtype != 0x01/*MEDIA_HARDDRIVE_DP*/) {
-            ssize_t skip_len = struct_len - 4; 
-            uint8_t buf[skip_len];
-            read(fd, buf, skip_len); // skip this part
-            continue;
-        }
-        //else
-        partuuid = get_partuuid_from_harddrive_device_path(fd);
-    }
-    if (!partuuid) throw std::runtime_error("Partition not found in device path");
+    auto mountpoint = find_mountpoint(st.st_rdev);
+    if (!mountpoint) throw detection_error(failure_reason::esp_not_mounted, device.string() + " is not mounted");
     //else
-    auto partition = search_partition("PARTUUID", *partuuid);
-    if (!partition) throw std::runtime_error("Partition not found(PARTUUID=" + (*partuuid) + ")");
-    return *partition;
+    return { *mountpoint, *mountpoint / std::filesystem::path(loader_path).relative_path() };
 }
 
+struct outcome {
+    int rst = 0;
+    std::string output;     // for stdout
+    std::vector<std::string> messages;  // for stderr(unless --quiet)
+};
+
 int main(int argc, char* argv[])
 {
     argparse::ArgumentParser program(argv[0]);
     program.add_argument("-q", "--quiet").default_value(false).implicit_value(true)
         .help("Don't show error message");
+    program.add_argument("-t", "--trace").default_value(false).implicit_value(true)
+        .help("Print diagnostic trace to stderr");
+    program.add_argument("--deadline").default_value(0).scan<'i', int>()
+        .help("Give up after this many milliseconds, print what is known so far and exit with 2(0: no deadline)");
+    program.add_argument("--metrics-file")
+        .help("Write an OpenMetrics textfile(for node_exporter textfile collector) to this path");
+    program.add_argument("--backend").default_value(std::string("auto"))
+        .help("Comma separated partition lookup backends to try in order, or 'auto' for the learned order(see README)");
+    program.add_argument("--race").default_value(false).implicit_value(true)
+        .help("Run backends concurrently and take the first answer(default: by-partuuid,udev-db,sysfs-geometry,native)");
+    program.add_argument("--cross-check").default_value(false).implicit_value(true)
+        .help("With --race, let every backend finish and report those disagreeing with the answer");
+    program.add_argument("--state-file")
+        .help("Keep a per-host record of the last answer and backend costs in this file(e.g. /var/cache/detect_efi_boot_partition/state)");
+    program.add_argument("--blkid-cache").default_value(false).implicit_value(true)
+        .help("Use a persistent blkid cache file and revalidate it instead of probing everything(implies --backend blkid-cache)");
+    program.add_argument("--blkid-cache-file").default_value(std::string("/run/blkid/blkid.tab"))
+        .help("blkid cache file used by --blkid-cache");
+    program.add_argument("--direct-io").default_value(false).implicit_value(true)
+        .help("Bypass the page cache(O_DIRECT) when reading partition tables natively");
+    program.add_argument("--no-device-io").default_value(false).implicit_value(true)
+        .help("Never open a block device: consult efivars, sysfs, udev database and /dev symlinks only");
+    program.add_argument("--ioprio").default_value(std::string("none"))
+        .help("I/O priority while probing devices: 'idle', 'best-effort'(level 7) or 'none'");
+    program.add_argument("--max-read-rate").default_value(0).scan<'i', int>()
+        .help("Cap partition table reads to this many KiB per second(0: unlimited, native backends)");
+    program.add_argument("--max-outstanding-reads").default_value(0).scan<'i', int>()
+        .help("Cap partition table reads in flight(0: unlimited, native backends)");
+    program.add_argument("--skip-classes").default_value(std::string("loop,ram,zram,nbd,optical,floppy"))
+        .help("Comma separated device classes never to open(disk,loop,ram,zram,nbd,optical,floppy,dm,md or 'none')");
+    program.add_argument("--skip-removable").default_value(false).implicit_value(true)
+        .help("Never open devices flagged removable in sysfs");
+    program.add_argument("--include-device").append().default_value(std::vector<std::string>())
+        .help("Glob of kernel device names to always consider(e.g. 'nvme*'), may be repeated");
+    program.add_argument("--exclude-device").append().default_value(std::vector<std::string>())
+        .help("Glob of kernel device names never to open(e.g. 'sd[c-z]'), may be repeated");
+    program.add_argument("--loader").default_value(false).implicit_value(true)
+        .help("Also print where the ESP is mounted and the absolute path of the loader the boot option names");
+    program.add_argument("--describe").default_value(false).implicit_value(true)
+        .help("Print the current boot option's device path in UEFI text form instead");
+    program.add_argument("--export-boot-config").default_value(false).implicit_value(true)
+        .help("Print every boot manager variable(Boot####, BootOrder...) decoded as NDJSON instead");
+    program.add_argument("--all-esps").default_value(false).implicit_value(true)
+        .help("List every EFI System Partition on the host as JSON instead, reading partition tables in parallel");
+    program.add_argument("--record-efivars")
+        .help("Save the boot related EFI variables to this snapshot file instead(for --replay-efivars elsewhere)");
+    program.add_argument("--replay-efivars")
+        .help("Read EFI variables from a snapshot file made by --record-efivars instead of efivarfs");
+    program.add_argument("--ovmf-vars")
+        .help("Read EFI variables from an EDK2 variable store file(a VM's OVMF_VARS.fd) instead of efivarfs");
+    program.add_argument("--image").append().default_value(std::vector<std::string>())
+        .help("Look for the boot partition in this disk image(raw, qcow2, or raw compressed with gzip, xz or zstd) instead of block devices and print its offset and size, may be repeated");
+    program.add_argument("--batch")
+        .help("Resolve every VM of this NDJSON manifest('-': stdin) instead, printing one JSON result per line(see README)");
+    program.add_argument("--batch-unordered").default_value(false).implicit_value(true)
+        .help("With --batch, print results as they complete rather than in manifest order");
+    program.add_argument("--result-cache")
+        .help("With --batch, keep results in this file and reuse them for VMs whose files haven't changed(device, inode, size, mtime)");
+    program.add_argument("--result-cache-verify").default_value(false).implicit_value(true)
+        .help("With --result-cache, reuse a result only if the image's partition table region hashes the same as before");
     try {
         program.parse_args(argc, argv);
     }
@@ -183,18 +153,323 @@ int main(int argc, char* argv[])
     }
 
     bool quiet = program.get<bool>("--quiet");
+    trace_enabled = program.get<bool>("--trace");
+    auto metrics_file = program.present("--metrics-file");
+    auto deadline_ms = program.get<int>("--deadline");
+    auto bytes_read_at_start = storage_bytes_read();
 
-    if (!std::filesystem::is_directory("/sys/firmware/efi/efivars")) {
-        if (!quiet) std::cerr << "No EFI variables available" << std::endl;
-        return 1;
+    resolver_options options;
+    auto backends = program.get<std::string>("--backend");
+    for (size_t pos = 0; backends != "auto" && pos <= backends.size();) {
+        auto comma = std::min(backends.find(',', pos), backends.size());
+        auto name = backends.substr(pos, comma - pos);
+        pos = comma + 1;
+        // aliases from when only one backend could be selected
+        if (name == "probe") name = "blkid-probe";
+        else if (name == "cache") name = "blkid-cache";
+        if (name == "metadata") {
+            options.backends.insert(options.backends.end(), { "by-partuuid", "udev-db" });
+            continue;
+        }
+        //else
+        if (!find_backend(name)) {
+            std::cerr << "Unknown backend: " << name << std::endl << program;
+            return -1;
+        }
+        options.backends.push_back(name);
     }
-    //else
+    options.race = program.get<bool>("--race");
+    options.cross_check = program.get<bool>("--cross-check");
+    if (auto state_file = program.present("--state-file")) options.state_file = *state_file;
+    if (program.get<bool>("--blkid-cache")) {
+        options.backends = { "blkid-cache" };
+        options.blkid_cache_file = program.get<std::string>("--blkid-cache-file");
+    }
+    options.direct_io = program.get<bool>("--direct-io");
+    if (program.get<bool>("--no-device-io")) {
+        options.no_device_io = true;
+        device_io_forbidden = true;
+    }
+    auto ioprio = program.get<std::string>("--ioprio");
+    if (ioprio == "idle") options.ioprio = io_priority::idle;
+    else if (ioprio == "best-effort") options.ioprio = io_priority::best_effort_lowest;
+    else if (ioprio != "none") {
+        std::cerr << "Unknown I/O priority: " << ioprio << std::endl << program;
+        return -1;
+    }
+    auto max_read_rate = program.get<int>("--max-read-rate");
+    auto max_outstanding_reads = program.get<int>("--max-outstanding-reads");
+    if (max_read_rate < 0 || max_outstanding_reads < 0) {
+        std::cerr << "Read limits must not be negative" << std::endl << program;
+        return -1;
+    }
+    read_budget.configure((uint64_t)max_read_rate * 1024, max_outstanding_reads);
+    options.filter.excluded_classes.clear();
+    auto skip_classes = program.get<std::string>("--skip-classes");
+    for (size_t pos = 0; skip_classes != "none" && pos <= skip_classes.size();) {
+        auto comma = std::min(skip_classes.find(',', pos), skip_classes.size());
+        auto name = skip_classes.substr(pos, comma - pos);
+        pos = comma + 1;
+        if (name.empty()) continue;
+        //else
+        auto cls = device_class_from_string(name);
+        if (!cls) {
+            std::cerr << "Unknown device class: " << name << std::endl << program;
+            return -1;
+        }
+        options.filter.excluded_classes.insert(*cls);
+    }
+    options.filter.exclude_removable = program.get<bool>("--skip-removable");
+    options.filter.include_globs = program.get<std::vector<std::string>>("--include-device");
+    options.filter.exclude_globs = program.get<std::vector<std::string>>("--exclude-device");
+
+    std::unique_ptr<efivar_source> efivars;
+    auto replay_file = program.present("--replay-efivars");
+    auto ovmf_vars_file = program.present("--ovmf-vars");
     try {
-        std::cout << detect_efi_boot_partition().string() << std::endl;
+        if (replay_file) efivars = std::make_unique<efivar_snapshot>(*replay_file);
+        else if (ovmf_vars_file) efivars = std::make_unique<edk2_varstore>(*ovmf_vars_file);
+        else efivars = std::make_unique<efivarfs>();
     }
     catch (const std::runtime_error& e) {
-        if (!quiet) std::cerr << e.what() << std::endl;
+        std::cerr << e.what() << std::endl;
         return 1;
     }
-    return 0;
+    // a file stands in for efivarfs even on a host without EFI
+    bool efivars_available = replay_file || ovmf_vars_file || std::filesystem::is_directory("/sys/firmware/efi/efivars");
+
+    // runs on a worker thread with --deadline, so nothing written here may be needed after a timeout
+    // but the atomics of metrics
+    bool with_loader = program.get<bool>("--loader");
+    auto detect = [&options, &efivars, efivars_available, with_loader]() -> outcome {
+        if (!efivars_available) {
+            metrics.failure = failure_reason::no_efivars;
+            return { 1, "", { "No EFI variables available" } };
+        }
+        //else
+        try {
+            std::string loader_path;
+            auto device = detect_efi_boot_partition(options, *efivars, with_loader? &loader_path : nullptr);
+            outcome result { 0, device.string(), {} };
+            if (with_loader) {
+                auto [mountpoint, loader] = locate_loader(device, loader_path);
+                result.output += "\n" + mountpoint.string() + "\n" + loader.string();
+            }
+            for (const auto& disagreement : metrics.disagreements) {
+                result.messages.push_back("Backend disagrees: " + disagreement);
+            }
+            return result;
+        }
+        catch (const detection_error& e) {
+            metrics.failure = e.reason();
+            return { 1, "", { e.what() } };
+        }
+        catch (const std::runtime_error& e) {
+            metrics.failure = failure_reason::internal;
+            return { 1, "", { e.what() } };
+        }
+    };
+
+    // every ESP instead of the one booted from; efivars only mark which of them that is
+    auto list_esps = [&options, &efivars, efivars_available]() -> outcome {
+        if (options.no_device_io) return { 1, "", { "--all-esps reads partition tables and can't be combined with --no-device-io" } };
+        //else
+        std::optional<partition_id> booted;
+        std::vector<std::string> messages;
+        if (efivars_available) {
+            try {
+                booted = read_boot_partition_query(*efivars).id;
+            }
+            catch (const std::runtime_error& e) {
+                messages.push_back(std::string("BootCurrent ESP unknown: ") + e.what());
+            }
+        }
+        try {
+            phase_timer timer("search");
+            auto esps = scan_all_esps(options);
+            for (auto& esp : esps) esp.boot_current = booted && esp.id == *booted;
+            return { 0, esps_to_json(esps), messages };
+        }
+        catch (const std::runtime_error& e) {
+            metrics.failure = failure_reason::internal;
+            messages.push_back(e.what());
+            return { 1, "", messages };
+        }
+    };
+
+    auto describe = [&efivars]() -> outcome {
+        try {
+            return { 0, describe_boot_option(*efivars), {} };
+        }
+        catch (const detection_error& e) {
+            metrics.failure = e.reason();
+            return { 1, "", { e.what() } };
+        }
+        catch (const std::runtime_error& e) {
+            metrics.failure = failure_reason::internal;
+            return { 1, "", { e.what() } };
+        }
+    };
+
+    auto export_config = [&efivars]() -> outcome {
+        try {
+            phase_timer timer("efivars");
+            return { 0, export_boot_config(*efivars), {} };
+        }
+        catch (const std::runtime_error& e) {
+            metrics.failure = failure_reason::no_efivars;
+            return { 1, "", { e.what() } };
+        }
+    };
+
+    // offline: partition tables parsed out of image files, no block device involved
+    auto images = program.get<std::vector<std::string>>("--image");
+    auto locate_in_images = [&efivars, efivars_available, &images]() -> outcome {
+        if (!efivars_available) {
+            metrics.failure = failure_reason::no_efivars;
+            return { 1, "", { "No EFI variables available(--replay-efivars or --ovmf-vars?)" } };
+        }
+        //else
+        try {
+            auto query = read_boot_partition_query(*efivars);
+            phase_timer timer("search");
+            auto found = find_partition_in_images({ images.begin(), images.end() }, query.id);
+            if (found.empty()) throw detection_error(failure_reason::partition_not_found, "Partition not found in the images(PARTUUID=" + query.partuuid + ")");
+            //else
+            outcome result;
+            for (const auto& [image, part] : found) {
+                if (!result.output.empty()) result.output += '\n';
+                result.output += std::to_string(part.start) + ' ' + std::to_string(part.size) + ' '
+                    + std::to_string(part.partno) + ' ' + image.string();
+            }
+            metrics.device = found.front().image.string();
+            return result;
+        }
+        catch (const detection_error& e) {
+            metrics.failure = e.reason();
+            return { 1, "", { e.what() } };
+        }
+        catch (const std::runtime_error& e) {
+            metrics.failure = failure_reason::internal;
+            return { 1, "", { e.what() } };
+        }
+    };
+
+    // many VMs offline at once, each with efivars and disk image files of its own
+    auto batch_file = program.present("--batch");
+    auto result_cache_file = program.present("--result-cache");
+    batch_options batch_opts;
+    batch_opts.ordered = !program.get<bool>("--batch-unordered");
+    batch_opts.verify_cache = program.get<bool>("--result-cache-verify");
+    auto batch = [&batch_file, &result_cache_file, &batch_opts]() -> outcome {
+        std::ifstream file;
+        if (*batch_file != "-") {
+            file.open(*batch_file);
+            if (!file) return { 1, "", { "Cannot open " + *batch_file } };
+        }
+        //else
+        try {
+            std::unique_ptr<result_cache> cache;
+            if (result_cache_file) cache = std::make_unique<result_cache>(*result_cache_file);
+            batch_opts.cache = cache.get();
+            auto summary = run_batch(*batch_file != "-"? file : std::cin, STDOUT_FILENO, batch_opts);
+            trace(summary.entries, " manifest entries, ", summary.failed, " failed, ", summary.cached, " from the result cache");
+            if (cache) cache->save();
+            if (summary.failed > 0) {
+                return { 1, "", { std::to_string(summary.failed) + " of " + std::to_string(summary.entries) + " manifest entries failed" } };
+            }
+            //else
+            return { 0, "", {} };
+        }
+        catch (const std::runtime_error& e) {
+            metrics.failure = failure_reason::internal;
+            return { 1, "", { e.what() } };
+        }
+    };
+
+    auto record_file = program.present("--record-efivars");
+    auto record = [&efivars, &record_file]() -> outcome {
+        try {
+            phase_timer timer("efivars");
+            auto count = record_efivar_snapshot(*efivars, *record_file);
+            trace(count, " EFI variables recorded to ", *record_file);
+            return { 0, "", {} };
+        }
+        catch (const std::runtime_error& e) {
+            metrics.failure = failure_reason::no_efivars;
+            return { 1, "", { e.what() } };
+        }
+    };
+
+    auto finish = [&](Metrics& m) {
+        m.device_opens = device_open_count;
+        trace("block devices opened: ", m.device_opens);
+        if (!metrics_file) return;
+        //else
+        auto bytes_read_at_end = storage_bytes_read();
+        if (bytes_read_at_start && bytes_read_at_end) m.bytes_read = *bytes_read_at_end - *bytes_read_at_start;
+        try {
+            m.write(*metrics_file);
+        }
+        catch (const std::runtime_error& e) {
+            if (!quiet) std::cerr << e.what() << std::endl;
+        }
+    };
+
+    std::function<outcome()> run = detect;
+    bool on_host_devices = true;    // looks partitions up among the host's block devices(detect, list_esps)
+    if (program.get<bool>("--all-esps")) run = list_esps;
+    else if (program.get<bool>("--describe")) { run = describe; on_host_devices = false; }
+    else if (program.get<bool>("--export-boot-config")) { run = export_config; on_host_devices = false; }
+    else if (record_file) { run = record; on_host_devices = false; }
+    else if (!images.empty()) { run = locate_in_images; on_host_devices = false; }
+    else if (batch_file) { run = batch; on_host_devices = false; }
+    // overlaps with the efivar reads; not worth a thread for variables from a file, taken from another machine(or VM)
+    if (on_host_devices && !replay_file && !ovmf_vars_file) prefetch_block_devices();
+
+    outcome result;
+    if (deadline_ms > 0) {
+        auto start = std::chrono::steady_clock::now();
+        auto promise = std::make_shared<std::promise<outcome>>();
+        auto future = promise->get_future();
+        std::thread([promise, run]() { promise->set_value(run()); }).detach();
+        if (future.wait_for(std::chrono::milliseconds(deadline_ms)) == std::future_status::timeout) {
+            // the worker may be stuck in a read from a dead device: report what is known and leave it behind
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            Metrics partial;
+            partial.failure = failure_reason::deadline_exceeded;
+            partial.phase_seconds.emplace_back(metrics.current_phase.load(), elapsed.count());
+            partial.devices_scanned = metrics.devices_scanned.load();
+            partial.devices_excluded = metrics.devices_excluded.load();
+            if (metrics.partuuid_known) partial.partuuid = metrics.partuuid;
+            if (!quiet) {
+                auto boot_current = metrics.boot_current.load();
+                char boot_current_str[8] = "unknown";
+                if (boot_current >= 0) sprintf(boot_current_str, "%04X", boot_current);
+                std::cerr << "Deadline of " << deadline_ms << "ms exceeded in phase " << metrics.current_phase.load()
+                    << " (BootCurrent=" << boot_current_str
+                    << ", PARTUUID=" << (partial.partuuid.empty()? "unknown" : partial.partuuid)
+                    << ", devices scanned=" << partial.devices_scanned << ")" << std::endl;
+            }
+            finish(partial);
+            std::cout.flush();
+            _exit(2);
+        }
+        //else
+        result = future.get();
+    } else {
+        result = run();
+    }
+
+    if (!result.output.empty()) std::cout << result.output << std::endl;
+    if (!quiet) {
+        for (const auto& message : result.messages) std::cerr << message << std::endl;
+    }
+    finish(metrics);
+    if (racers_running()) {
+        std::cout.flush();
+        _exit(result.rst);
+    }
+    //else
+    return result.rst;
 }
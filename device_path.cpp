@@ -0,0 +1,422 @@
+/*
+ * detect_efi_boot_partition
+ *  UEFI device path to text
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <string.h>
+
+#include <array>
+#include <string_view>
+
+#include "device_path.h"
+#include "guid.h"
+#include "utf16.h"
+
+// bounded output into the caller's buffer, counting what didn't fit(snprintf() semantics)
+class text_sink {
+    char* buf_;
+    size_t size_;
+    size_t len_ = 0;
+public:
+    text_sink(char* buf, size_t size) : buf_(buf), size_(size) {}
+    size_t length() const { return len_; }
+    void terminate() { if (size_ > 0) buf_[len_ < size_? len_ : size_ - 1] = '\0'; }
+
+    void put(char c)
+    {
+        if (len_ + 1 < size_) buf_[len_] = c;
+        len_++;
+    }
+    void put(std::string_view s)
+    {
+        if (len_ + 1 < size_) memcpy(buf_ + len_, s.data(), std::min(s.size(), size_ - 1 - len_));
+        len_ += s.size();
+    }
+    void dec(uint64_t v)
+    {
+        char digits[20];
+        int n = 0;
+        do { digits[n++] = '0' + v % 10; v /= 10; } while (v);
+        while (n) put(digits[--n]);
+    }
+    void hex(uint64_t v, int min_digits = 1)  // lowercase, no prefix
+    {
+        static const char xdigits[] = "0123456789abcdef";
+        char digits[16];
+        int n = 0;
+        do { digits[n++] = xdigits[v & 0xf]; v >>= 4; } while (v || n < min_digits);
+        while (n) put(digits[--n]);
+    }
+    void hex0x(uint64_t v) { put("0x"); hex(v); }
+    void bytes(const uint8_t* p, size_t len) { for (size_t i = 0; i < len; i++) hex(p[i], 2); }
+    void guid(const uint8_t* p)
+    {
+        char text[Guid::text_length];
+        Guid::from_efi_bytes(p).format(text);
+        put(std::string_view(text, sizeof(text)));
+    }
+    void utf16(const uint8_t* p, size_t len)
+    {
+        const uint8_t* end = p + len;
+        while (auto cp = next_utf16le(p, end)) {
+            if (*cp == 0) return;
+            //else
+            char utf8[4];
+            put(std::string_view(utf8, encode_utf8(*cp, utf8)));
+        }
+        put("?");   // unpaired surrogate
+    }
+    void ascii(const uint8_t* p, size_t len)
+    {
+        for (size_t i = 0; i < len && p[i]; i++) put((char)p[i]);
+    }
+};
+
+static inline uint16_t u16(const uint8_t* p) { return p[0] | p[1] << 8; }
+static inline uint32_t u32(const uint8_t* p) { return u16(p) | (uint32_t)u16(p + 2) << 16; }
+static inline uint64_t u64(const uint8_t* p) { return u32(p) | (uint64_t)u32(p + 4) << 32; }
+
+// formatters get the node's data(after the 4 byte header), at least min_len bytes of it
+typedef void (*node_formatter)(text_sink& out, const uint8_t* d, size_t len);
+
+// hardware
+static void pci(text_sink& out, const uint8_t* d, size_t)
+{
+    out.put("Pci("); out.hex0x(d[1]); out.put(','); out.hex0x(d[0]); out.put(')');
+}
+static void pccard(text_sink& out, const uint8_t* d, size_t) { out.put("PcCard("); out.hex0x(d[0]); out.put(')'); }
+static void memmap(text_sink& out, const uint8_t* d, size_t)
+{
+    out.put("MemoryMapped("); out.hex0x(u32(d)); out.put(','); out.hex0x(u64(d + 4)); out.put(','); out.hex0x(u64(d + 12)); out.put(')');
+}
+static void vendor(text_sink& out, const char* name, const uint8_t* d, size_t len)
+{
+    out.put(name); out.put('('); out.guid(d);
+    if (len > 16) { out.put(','); out.bytes(d + 16, len - 16); }
+    out.put(')');
+}
+static void venhw(text_sink& out, const uint8_t* d, size_t len) { vendor(out, "VenHw", d, len); }
+static void ctrl(text_sink& out, const uint8_t* d, size_t) { out.put("Ctrl("); out.hex0x(u32(d)); out.put(')'); }
+static void bmc(text_sink& out, const uint8_t* d, size_t)
+{
+    out.put("BMC("); out.hex0x(d[0]); out.put(','); out.hex0x(u64(d + 1)); out.put(')');
+}
+
+// ACPI
+static void eisa_id(text_sink& out, uint32_t id)
+{
+    if ((id & 0xffff) != 0x41d0) { out.hex0x(id); return; }
+    //else
+    out.put("PNP"); out.hex(id >> 16, 4);
+}
+static void acpi(text_sink& out, const uint8_t* d, size_t)
+{
+    auto hid = u32(d), uid = u32(d + 4);
+    if ((hid & 0xffff) == 0x41d0/*PNP*/) {
+        const char* name = nullptr;
+        switch (hid >> 16) {
+        case 0x0a03: name = "PciRoot"; break;
+        case 0x0a08: name = "PcieRoot"; break;
+        case 0x0604: name = "Floppy"; break;
+        case 0x0301: name = "Keyboard"; break;
+        case 0x0501: name = "Serial"; break;
+        case 0x0401: name = "ParallelPort"; break;
+        }
+        if (name) { out.put(name); out.put('('); out.hex0x(uid); out.put(')'); return; }
+    }
+    //else
+    out.put("Acpi("); eisa_id(out, hid); out.put(','); out.hex0x(uid); out.put(')');
+}
+static void acpi_ex(text_sink& out, const uint8_t* d, size_t len)
+{
+    // HID, UID, CID, then HIDSTR, UIDSTR, CIDSTR as NUL terminated ASCII
+    const uint8_t* strs[3] = {};
+    const uint8_t* p = d + 12;
+    const uint8_t* end = d + len;
+    for (auto& s : strs) {
+        if (p >= end) break;
+        //else
+        s = p;
+        while (p < end && *p) p++;
+        p++;
+    }
+    out.put("AcpiEx("); eisa_id(out, u32(d)); out.put(','); eisa_id(out, u32(d + 8)); out.put(','); out.hex0x(u32(d + 4));
+    for (int i : { 0, 2, 1 }) {    // HIDSTR, CIDSTR, UIDSTR
+        out.put(',');
+        if (strs[i]) out.ascii(strs[i], end - strs[i]);
+    }
+    out.put(')');
+}
+static void acpi_adr(text_sink& out, const uint8_t* d, size_t len)
+{
+    out.put("AcpiAdr(");
+    for (size_t i = 0; i + 4 <= len; i += 4) {
+        if (i) out.put(',');
+        out.hex0x(u32(d + i));
+    }
+    out.put(')');
+}
+
+// messaging
+static void atapi(text_sink& out, const uint8_t* d, size_t)
+{
+    out.put("Ata("); out.put(d[0]? "Secondary" : "Primary"); out.put(','); out.put(d[1]? "Slave" : "Master");
+    out.put(','); out.hex0x(u16(d + 2)); out.put(')');
+}
+static void scsi(text_sink& out, const uint8_t* d, size_t) { out.put("Scsi("); out.hex0x(u16(d)); out.put(','); out.hex0x(u16(d + 2)); out.put(')'); }
+static void fibre(text_sink& out, const uint8_t* d, size_t) { out.put("Fibre("); out.hex0x(u64(d + 4)); out.put(','); out.hex0x(u64(d + 12)); out.put(')'); }
+static void usb(text_sink& out, const uint8_t* d, size_t) { out.put("USB("); out.hex0x(d[0]); out.put(','); out.hex0x(d[1]); out.put(')'); }
+static void i2o(text_sink& out, const uint8_t* d, size_t) { out.put("I2O("); out.hex0x(u32(d)); out.put(')'); }
+static void venmsg(text_sink& out, const uint8_t* d, size_t len) { vendor(out, "VenMsg", d, len); }
+static void mac(text_sink& out, const uint8_t* d, size_t)
+{
+    auto if_type = d[32];
+    out.put("MAC("); out.bytes(d, (if_type == 0 || if_type == 1)? 6 : 32); out.put(','); out.hex0x(if_type); out.put(')');
+}
+static void ipv4_addr(text_sink& out, const uint8_t* a)
+{
+    for (int i = 0; i < 4; i++) { if (i) out.put('.'); out.dec(a[i]); }
+}
+static void protocol(text_sink& out, uint16_t proto)
+{
+    if (proto == 6) out.put("TCP");
+    else if (proto == 17) out.put("UDP");
+    else out.hex0x(proto);
+}
+static void ipv4(text_sink& out, const uint8_t* d, size_t len)
+{
+    // local, remote, local port, remote port, protocol, static[, gateway, subnet mask]
+    out.put("IPv4("); ipv4_addr(out, d + 4); out.put(','); protocol(out, u16(d + 12)); out.put(',');
+    out.put(d[14]? "Static" : "DHCP"); out.put(','); ipv4_addr(out, d);
+    if (len >= 23) { out.put(','); ipv4_addr(out, d + 15); out.put(','); ipv4_addr(out, d + 19); }
+    out.put(')');
+}
+static void ipv6_addr(text_sink& out, const uint8_t* a)
+{
+    for (int i = 0; i < 16; i += 2) { if (i) out.put(':'); out.hex(a[i] << 8 | a[i + 1]); }
+}
+static void ipv6(text_sink& out, const uint8_t* d, size_t len)
+{
+    // local, remote, local port, remote port, protocol, origin[, prefix length, gateway]
+    static const char* origins[] = { "Static", "StatelessAutoConfigure", "StatefulAutoConfigure" };
+    out.put("IPv6("); ipv6_addr(out, d + 16); out.put(','); protocol(out, u16(d + 36)); out.put(',');
+    if (d[38] < 3) out.put(origins[d[38]]); else out.hex0x(d[38]);
+    out.put(','); ipv6_addr(out, d);
+    if (len >= 56) { out.put(','); ipv6_addr(out, d + 40); out.put(','); out.dec(d[39]); }
+    out.put(')');
+}
+static void usb_class(text_sink& out, const uint8_t* d, size_t)
+{
+    out.put("UsbClass("); out.hex0x(u16(d)); out.put(','); out.hex0x(u16(d + 2)); out.put(',');
+    out.hex0x(d[4]); out.put(','); out.hex0x(d[5]); out.put(','); out.hex0x(d[6]); out.put(')');
+}
+static void usb_wwid(text_sink& out, const uint8_t* d, size_t len)
+{
+    out.put("UsbWwid("); out.hex0x(u16(d + 2)); out.put(','); out.hex0x(u16(d + 4)); out.put(',');
+    out.hex0x(u16(d)); out.put(",\""); out.utf16(d + 6, len - 6); out.put("\")");
+}
+static void unit(text_sink& out, const uint8_t* d, size_t) { out.put("Unit("); out.hex0x(d[0]); out.put(')'); }
+static void sata(text_sink& out, const uint8_t* d, size_t)
+{
+    out.put("Sata("); out.hex0x(u16(d)); out.put(','); out.hex0x(u16(d + 2)); out.put(','); out.hex0x(u16(d + 4)); out.put(')');
+}
+static void vlan(text_sink& out, const uint8_t* d, size_t) { out.put("Vlan("); out.dec(u16(d)); out.put(')'); }
+static void nvme(text_sink& out, const uint8_t* d, size_t)
+{
+    static const char xdigits[] = "0123456789ABCDEF";
+    out.put("NVMe("); out.hex0x(u32(d)); out.put(',');
+    for (int i = 7; i >= 0; i--) {  // EUI-64, most significant byte first
+        out.put(xdigits[d[4 + i] >> 4]); out.put(xdigits[d[4 + i] & 0xf]);
+        if (i) out.put('-');
+    }
+    out.put(')');
+}
+static void uri(text_sink& out, const uint8_t* d, size_t len) { out.put("Uri("); out.ascii(d, len); out.put(')'); }
+static void ufs(text_sink& out, const uint8_t* d, size_t) { out.put("UFS("); out.hex0x(d[0]); out.put(','); out.hex0x(d[1]); out.put(')'); }
+static void sd(text_sink& out, const uint8_t* d, size_t) { out.put("SD("); out.hex0x(d[0]); out.put(')'); }
+static void emmc(text_sink& out, const uint8_t* d, size_t) { out.put("eMMC("); out.hex0x(d[0]); out.put(')'); }
+
+// media
+static void hd(text_sink& out, const uint8_t* d, size_t)
+{
+    // partition number, start, size, signature[16], MBR type, signature type
+    out.put("HD("); out.dec(u32(d)); out.put(',');
+    switch (d[37]) {
+    case 1: out.put("MBR,0x"); out.hex(u32(d + 20), 8); break;
+    case 2: out.put("GPT,"); out.guid(d + 20); break;
+    default: out.dec(d[37]); out.put(",0"); break;
+    }
+    out.put(','); out.hex0x(u64(d + 4)); out.put(','); out.hex0x(u64(d + 12)); out.put(')');
+}
+static void cdrom(text_sink& out, const uint8_t* d, size_t)
+{
+    out.put("CDROM("); out.hex0x(u32(d)); out.put(','); out.hex0x(u64(d + 4)); out.put(','); out.hex0x(u64(d + 12)); out.put(')');
+}
+static void venmedia(text_sink& out, const uint8_t* d, size_t len) { vendor(out, "VenMedia", d, len); }
+static void filepath(text_sink& out, const uint8_t* d, size_t len) { out.utf16(d, len); }
+static void media_protocol(text_sink& out, const uint8_t* d, size_t) { out.put("Media("); out.guid(d); out.put(')'); }
+static void fv_file(text_sink& out, const uint8_t* d, size_t) { out.put("FvFile("); out.guid(d); out.put(')'); }
+static void fv(text_sink& out, const uint8_t* d, size_t) { out.put("Fv("); out.guid(d); out.put(')'); }
+static void offset(text_sink& out, const uint8_t* d, size_t)
+{
+    out.put("Offset("); out.hex0x(u64(d + 4)); out.put(','); out.hex0x(u64(d + 12)); out.put(')');
+}
+
+// BIOS boot specification
+static void bbs(text_sink& out, const uint8_t* d, size_t len)
+{
+    out.put("BBS(");
+    switch (u16(d)) {
+    case 0x01: out.put("Floppy"); break;
+    case 0x02: out.put("HD"); break;
+    case 0x03: out.put("CDROM"); break;
+    case 0x04: out.put("PCMCIA"); break;
+    case 0x05: out.put("USB"); break;
+    case 0x06: out.put("Network"); break;
+    default: out.hex0x(u16(d)); break;
+    }
+    out.put(",\""); out.ascii(d + 4, len - 4); out.put("\","); out.hex0x(u16(d + 2)); out.put(')');
+}
+
+struct node_format {
+    uint8_t type;
+    uint8_t subtype;
+    uint16_t min_len;   // of the node's data; shorter nodes are rendered generically
+    node_formatter format;
+};
+
+static constexpr node_format node_formats[] = {
+    { 0x01, 0x01, 2, pci },
+    { 0x01, 0x02, 1, pccard },
+    { 0x01, 0x03, 20, memmap },
+    { 0x01, 0x04, 16, venhw },
+    { 0x01, 0x05, 4, ctrl },
+    { 0x01, 0x06, 9, bmc },
+    { 0x02, 0x01, 8, acpi },
+    { 0x02, 0x02, 12, acpi_ex },
+    { 0x02, 0x03, 4, acpi_adr },
+    { 0x03, 0x01, 4, atapi },
+    { 0x03, 0x02, 4, scsi },
+    { 0x03, 0x03, 20, fibre },
+    { 0x03, 0x05, 2, usb },
+    { 0x03, 0x06, 4, i2o },
+    { 0x03, 0x0a, 16, venmsg },
+    { 0x03, 0x0b, 33, mac },
+    { 0x03, 0x0c, 15, ipv4 },
+    { 0x03, 0x0d, 39, ipv6 },
+    { 0x03, 0x0f, 7, usb_class },
+    { 0x03, 0x10, 6, usb_wwid },
+    { 0x03, 0x11, 1, unit },
+    { 0x03, 0x12, 6, sata },
+    { 0x03, 0x14, 2, vlan },
+    { 0x03, 0x17, 12, nvme },
+    { 0x03, 0x18, 0, uri },
+    { 0x03, 0x19, 2, ufs },
+    { 0x03, 0x1a, 1, sd },
+    { 0x03, 0x1d, 1, emmc },
+    { 0x04, 0x01, 38, hd },
+    { 0x04, 0x02, 20, cdrom },
+    { 0x04, 0x03, 16, venmedia },
+    { 0x04, 0x04, 0, filepath },
+    { 0x04, 0x05, 16, media_protocol },
+    { 0x04, 0x06, 16, fv_file },
+    { 0x04, 0x07, 16, fv },
+    { 0x04, 0x08, 20, offset },
+    { 0x05, 0x01, 4, bbs },
+};
+
+// (type 1-5, subtype < 64) -> 1 + index into node_formats, 0 for none; built at compile time
+static constexpr int max_type = 5, max_subtype = 64;
+typedef std::array<std::array<uint8_t, max_subtype>, max_type + 1> dispatch_table_t;
+
+static constexpr dispatch_table_t make_dispatch_table()
+{
+    dispatch_table_t table {};
+    for (size_t i = 0; i < sizeof(node_formats) / sizeof(node_formats[0]); i++) {
+        const auto& f = node_formats[i];
+        if (f.type > max_type || f.subtype >= max_subtype || table[f.type][f.subtype] != 0) throw "bad node_formats entry";
+        //else
+        table[f.type][f.subtype] = (uint8_t)(i + 1);
+    }
+    return table;
+}
+
+static constexpr dispatch_table_t dispatch_table = make_dispatch_table();
+static_assert(sizeof(node_formats) / sizeof(node_formats[0]) < 256);
+
+// nodes without a text form of their own, as DevicePathToText renders them
+static void generic(text_sink& out, uint8_t type, uint8_t subtype, const uint8_t* d, size_t len)
+{
+    static const char* names[] = { nullptr, "HardwarePath(", "AcpiPath(", "Msg(", "MediaPath(", "BbsPath(" };
+    if (type >= 1 && type <= 5) {
+        out.put(names[type]);
+    } else {
+        out.put("Path("); out.dec(type); out.put(',');
+    }
+    out.dec(subtype);
+    if (len > 0) { out.put(','); out.bytes(d, len); }
+    out.put(')');
+}
+
+size_t device_path_to_text(const uint8_t* path, size_t len, char* out, size_t out_size)
+{
+    text_sink sink(out, out_size);
+    const uint8_t* p = path;
+    const uint8_t* end = path + len;
+    bool first = true;
+    while (true) {
+        if (end - p < 4) { sink.put('?'); break; }  // ran out before End Entire Device Path
+        //else
+        uint8_t type = p[0], subtype = p[1];
+        uint16_t node_len = u16(p + 2);
+        if (node_len < 4 || node_len > end - p) { sink.put('?'); break; }
+        //else
+        if (type == 0x7f) {
+            if (subtype == 0xff) break;  // End Entire Device Path
+            //else
+            sink.put(',');  // End This Instance: another instance follows
+            first = true;
+            p += node_len;
+            continue;
+        }
+        //else
+        if (!first) sink.put('/');
+        first = false;
+        const uint8_t* data = p + 4;
+        size_t data_len = node_len - 4;
+        uint8_t index = (type <= max_type && subtype < max_subtype)? dispatch_table[type][subtype] : 0;
+        if (index && data_len >= node_formats[index - 1].min_len) node_formats[index - 1].format(sink, data, data_len);
+        else generic(sink, type, subtype, data, data_len);
+        p += node_len;
+    }
+    sink.terminate();
+    return sink.length();
+}
+
+std::string device_path_text(const uint8_t* path, size_t len)
+{
+    char text[1024];
+    auto text_len = device_path_to_text(path, len, text, sizeof(text));
+    if (text_len < sizeof(text)) return std::string(text, text_len);
+    //else
+    std::string long_text(text_len + 1, '\0');
+    device_path_to_text(path, len, long_text.data(), long_text.size());
+    long_text.resize(text_len);
+    return long_text;
+}
+
+size_t device_path_size(const uint8_t* path, size_t len)
+{
+    size_t pos = 0;
+    while (len - pos >= 4) {
+        uint16_t node_len = u16(path + pos + 2);
+        if (node_len < 4 || node_len > len - pos) return 0;
+        //else
+        bool end_entire = path[pos] == 0x7f && path[pos + 1] == 0xff;
+        pos += node_len;
+        if (end_entire) return pos;
+    }
+    return 0;
+}
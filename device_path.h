@@ -0,0 +1,29 @@
+/*
+ * detect_efi_boot_partition
+ *  UEFI device path to text
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __DEVICE_PATH_H__
+#define __DEVICE_PATH_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
+// UEFI DevicePathToText(DisplayOnly = FALSE, AllowShortcuts = FALSE) of the device path in path[0..len),
+// e.g. "PciRoot(0x0)/Pci(0x1d,0x0)/NVMe(0x1,...)/HD(1,GPT,...,0x800,0x100000)/\EFI\debian\shimx64.efi".
+// Written into out[0..out_size), NUL terminated, without allocating. Returns the length of the whole text
+// like snprintf(): the text was truncated when that is out_size or more. Nodes without a text form of
+// their own are rendered generically(e.g. "Msg(19,...)"); a malformed node ends the text with "?".
+size_t device_path_to_text(const uint8_t* path, size_t len, char* out, size_t out_size);
+
+// device_path_to_text() into a string of whatever length it takes
+std::string device_path_text(const uint8_t* path, size_t len);
+
+// bytes of the device path at path[0..len) up to and including its End Entire Device Path node;
+// 0 when it is malformed or doesn't end within len. Load options may carry several in a row.
+size_t device_path_size(const uint8_t* path, size_t len);
+
+#endif // __DEVICE_PATH_H__
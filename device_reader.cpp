@@ -0,0 +1,123 @@
+/*
+ * detect_efi_boot_partition
+ *  Page cache friendly block device reader
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+
+#include "device_reader.h"
+#include "metrics.h"
+#include "io_throttle.h"
+
+std::atomic<uint64_t> device_open_count = 0;
+bool device_io_forbidden = false;
+
+void check_device_open(const std::filesystem::path& path)
+{
+    if (device_io_forbidden) {
+        throw detection_error(failure_reason::device_io_forbidden, "Refusing to open " + path.string() + " (--no-device-io)");
+    }
+    //else
+    device_open_count++;
+}
+
+device_reader::device_reader(const std::filesystem::path& path, bool _direct_io) : direct_io(_direct_io)
+{
+    check_device_open(path);
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | (direct_io? O_DIRECT : 0));
+    if (fd < 0) throw std::runtime_error("Cannot open " + path.string() + ": " + strerror(errno));
+    //else
+    struct stat st;
+    if (fstat(fd, &st) < 0) { ::close(fd); throw std::runtime_error("fstat() failed on " + path.string()); }
+    if (S_ISBLK(st.st_mode)) {
+        int ssz;
+        if (ioctl(fd, BLKGETSIZE64, &size_) < 0) size_ = 0;
+        if (ioctl(fd, BLKSSZGET, &ssz) == 0 && ssz >= 512) sector_size_ = ssz;
+    } else {
+        size_ = st.st_size;
+    }
+    if (!direct_io) posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);   // no readahead
+}
+
+device_reader::~device_reader()
+{
+    for (const auto& [offset, length] : cached_ranges) {
+        posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+    }
+    ::close(fd);
+}
+
+// per page of [begin, end)(page aligned), whether it is in the page cache already; nullopt if that can't be told
+std::optional<std::vector<unsigned char>> device_reader::resident_pages(uint64_t begin, uint64_t end) const
+{
+    // mapping doesn't fault anything in; mincore(2) only looks
+    auto map = mmap(nullptr, end - begin, PROT_READ, MAP_SHARED, fd, begin);
+    if (map == MAP_FAILED) return std::nullopt;
+    //else
+    std::vector<unsigned char> pages((end - begin) / page_size);
+    auto r = mincore(map, end - begin, pages.data());
+    munmap(map, end - begin);
+    if (r < 0) return std::nullopt;
+    //else
+    return pages;
+}
+
+void device_reader::pread(void* buf, size_t size, uint64_t offset)
+{
+    if (offset + size > size_) throw std::runtime_error("Read beyond end of device");
+    //else
+    io_budget::ticket ticket(read_budget, size);
+    if (!direct_io) {
+        auto begin = offset / page_size * page_size;
+        auto end = (offset + size + page_size - 1) / page_size * page_size;
+        auto resident = resident_pages(begin, end);
+        auto r = ::pread(fd, buf, size, offset);
+        if (r < (ssize_t)size) throw std::runtime_error("Short read from device");
+        //else
+        bytes_read_ += size;
+        // only the pages this read brought in are ours to drop; those cached before(a mounted ESP's, say) stay.
+        // When residency is unknown nothing is dropped.
+        if (!resident) return;
+        //else
+        for (size_t i = 0; i < resident->size();) {
+            if ((*resident)[i] & 1) { i++; continue; }
+            //else
+            auto run = i;
+            while (i < resident->size() && !((*resident)[i] & 1)) i++;
+            cached_ranges.emplace_back(begin + run * page_size, (i - run) * page_size);
+        }
+        return;
+    }
+    //else
+    // O_DIRECT wants offset, length and buffer aligned to the logical block size
+    auto begin = offset / sector_size_ * sector_size_;
+    auto end = std::min((offset + size + sector_size_ - 1) / sector_size_ * sector_size_, size_);
+    void* aligned;
+    if (posix_memalign(&aligned, std::max(sector_size_, 4096U), end - begin) != 0) throw std::bad_alloc();
+    std::unique_ptr<void, decltype(&free)> aligned_buf(aligned, free);
+    auto r = ::pread(fd, aligned, end - begin, begin);
+    if (r < (ssize_t)(offset + size - begin)) throw std::runtime_error("Short read from device");
+    //else
+    memcpy(buf, (const uint8_t*)aligned + (offset - begin), size);
+    bytes_read_ += end - begin;
+}
+
+uint64_t device_reader::page_cache_bytes() const
+{
+    uint64_t total = 0;
+    for (const auto& [offset, length] : cached_ranges) total += length;
+    return total;
+}
@@ -0,0 +1,52 @@
+/*
+ * detect_efi_boot_partition
+ *  Page cache friendly block device reader
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __DEVICE_READER_H__
+#define __DEVICE_READER_H__
+
+#include <unistd.h>
+
+#include <atomic>
+#include <vector>
+#include <optional>
+#include <filesystem>
+
+#include "partition_table.h"
+
+// Every block device open goes through here: counts opens, and throws instead once
+// device_io_forbidden is set(--no-device-io).
+extern std::atomic<uint64_t> device_open_count;
+extern bool device_io_forbidden;
+void check_device_open(const std::filesystem::path& path);
+
+// Reads exactly what is asked for: readahead is disabled with POSIX_FADV_RANDOM and pages the reads
+// brought into the page cache(not those cached already, see mincore(2)) are dropped again with
+// POSIX_FADV_DONTNEED on destruction, or the page cache is bypassed altogether with O_DIRECT.
+class device_reader : public block_reader {
+    int fd = -1;
+    bool direct_io;
+    uint64_t size_ = 0;
+    unsigned int sector_size_ = 512;
+    std::vector<std::pair<uint64_t, uint64_t>> cached_ranges;  // offset, length(page aligned) brought in by reads
+    uint64_t bytes_read_ = 0;
+    const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    std::optional<std::vector<unsigned char>> resident_pages(uint64_t begin, uint64_t end) const;
+public:
+    device_reader(const std::filesystem::path& path, bool _direct_io = false);
+    ~device_reader() override;
+    device_reader(const device_reader&) = delete;
+    device_reader& operator=(const device_reader&) = delete;
+
+    void pread(void* buf, size_t size, uint64_t offset) override;
+    uint64_t size() const override { return size_; }
+    unsigned int sector_size() const override { return sector_size_; }
+
+    uint64_t bytes_read() const { return bytes_read_; }
+    // bytes this reader pulled into the page cache, not counting pages which were cached already(0 with O_DIRECT)
+    uint64_t page_cache_bytes() const;
+};
+
+#endif // __DEVICE_READER_H__
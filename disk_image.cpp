@@ -0,0 +1,135 @@
+/*
+ * detect_efi_boot_partition
+ *  Raw disk image files(--image)
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdexcept>
+
+#include "disk_image.h"
+#include "qcow2.h"
+#include "compressed_image.h"
+#include "metrics.h"
+
+image_reader::image_reader(const std::filesystem::path& path)
+{
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("Cannot open " + path.string() + ": " + strerror(errno));
+    //else
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        throw std::runtime_error(path.string() + " is not a regular file");
+    }
+    //else
+    size_ = st.st_size;
+    if (size_ == 0) return;
+    //else
+    auto map = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        ::close(fd);
+        throw std::runtime_error("Cannot map " + path.string() + ": " + strerror(errno));
+    }
+    //else
+    map_ = (const uint8_t*)map;
+    madvise(map, size_, MADV_RANDOM);   // a partition table is a few scattered sectors; no readahead
+    sector_size_ = probe_image_sector_size(*this);
+}
+
+image_reader::~image_reader()
+{
+    if (map_) munmap((void*)map_, size_);
+    ::close(fd);
+}
+
+// SEEK_DATA finds no data before offset + size. Filesystems which can't tell report everything as data.
+bool image_reader::is_hole(uint64_t offset, size_t size) const
+{
+    auto data = lseek(fd, offset, SEEK_DATA);
+    if (data < 0) return errno == ENXIO;    // nothing but a hole up to the end of the file
+    //else
+    return (uint64_t)data >= offset + size;
+}
+
+const uint8_t* image_reader::view(uint64_t offset, size_t size)
+{
+    if (offset > size_ || size > size_ - offset || is_hole(offset, size)) return nullptr;
+    //else
+    return map_ + offset;
+}
+
+void image_reader::pread(void* buf, size_t size, uint64_t offset)
+{
+    if (offset > size_ || size > size_ - offset) throw std::runtime_error("Read beyond end of image");
+    //else
+    if (is_hole(offset, size)) memset(buf, 0, size);
+    else memcpy(buf, map_ + offset, size);
+}
+
+unsigned int probe_image_sector_size(block_reader& reader)
+{
+    // GPT header at LBA 1: byte 512 on most images, byte 4096 on those of 4Kn disks
+    static const uint64_t large_sector = 4096;
+    auto has_gpt_signature = [&reader](uint64_t offset) {
+        char signature[8];
+        if (reader.size() < offset + sizeof(signature)) return false;
+        //else
+        reader.pread(signature, sizeof(signature), offset);
+        return memcmp(signature, "EFI PART", 8) == 0;
+    };
+    return !has_gpt_signature(512) && has_gpt_signature(large_sector)? large_sector : 512;
+}
+
+std::unique_ptr<block_reader> open_image(const std::filesystem::path& path, int depth)
+{
+    uint8_t magic[6] = {};
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("Cannot open " + path.string() + ": " + strerror(errno));
+    //else
+    auto r = ::pread(fd, magic, sizeof(magic), 0);
+    ::close(fd);
+    if (r >= 4 && qcow2_reader::is_qcow2(magic)) return std::make_unique<qcow2_reader>(path, depth);
+    //else
+    if (auto reader = compressed_image_reader::open(path, magic)) return reader;
+    //else
+    return std::make_unique<image_reader>(path);
+}
+
+std::vector<std::filesystem::path> image_backing_files(const std::filesystem::path& path)
+{
+    std::vector<std::filesystem::path> chain;
+    for (auto image = qcow2_reader::backing_file(path); image; image = qcow2_reader::backing_file(*image)) {
+        if (chain.size() >= qcow2_reader::max_backing_depth) throw std::runtime_error(path.string() + ": qcow2 backing chain too long(loop?)");
+        //else
+        chain.push_back(*image);
+    }
+    return chain;
+}
+
+std::vector<image_partition> find_partition_in_images(const std::vector<std::filesystem::path>& images, const partition_id& id)
+{
+    std::vector<image_partition> found;
+    for (const auto& image : images) {
+        auto reader = open_image(image);
+        auto table = read_partition_table(*reader);
+        if (!table) {
+            trace(image.string(), ": no partition table");
+            continue;
+        }
+        //else
+        trace(image.string(), ": ", table->scheme == partition_table::scheme_t::gpt? "GPT" : "MBR", ", ",
+            table->partitions.size(), " partitions, sector size ", reader->sector_size());
+        for (const auto& part : table->partitions) {
+            if (part.id == id) found.push_back({ image, part });
+        }
+    }
+    return found;
+}
@@ -0,0 +1,58 @@
+/*
+ * detect_efi_boot_partition
+ *  Raw disk image files(--image)
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __DISK_IMAGE_H__
+#define __DISK_IMAGE_H__
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <filesystem>
+
+#include "partition_table.h"
+
+// A raw image mapped read-only: partition tables are parsed in place. Ranges lseek(SEEK_DATA) reports as
+// holes of a sparse image are never touched; they read as zeros without faulting the mapping in.
+class image_reader : public block_reader {
+    int fd = -1;
+    const uint8_t* map_ = nullptr;
+    uint64_t size_ = 0;
+    unsigned int sector_size_ = 512;
+    bool is_hole(uint64_t offset, size_t size) const;
+public:
+    explicit image_reader(const std::filesystem::path& path);  // throws when it can't be opened or mapped
+    ~image_reader() override;
+    image_reader(const image_reader&) = delete;
+    image_reader& operator=(const image_reader&) = delete;
+
+    void pread(void* buf, size_t size, uint64_t offset) override;
+    const uint8_t* view(uint64_t offset, size_t size) override;
+    uint64_t size() const override { return size_; }
+    // 512, or 4096 for images of 4Kn disks(GPT header found at byte 4096 rather than 512)
+    unsigned int sector_size() const override { return sector_size_; }
+};
+
+// 4096 if the GPT header is at byte 4096 rather than 512(image of a 4Kn disk), 512 otherwise
+unsigned int probe_image_sector_size(block_reader& reader);
+
+// a qcow2_reader for a qcow2 image, a compressed_image_reader for a gzip, xz or zstd compressed one(by their magic),
+// an image_reader otherwise; depth: of path in a backing chain
+std::unique_ptr<block_reader> open_image(const std::filesystem::path& path, int depth = 0);
+
+// the files the image at path reads from besides itself: its qcow2 backing chain, nearest first. Headers only.
+std::vector<std::filesystem::path> image_backing_files(const std::filesystem::path& path);
+
+struct image_partition {
+    std::filesystem::path image;
+    partition_entry partition;
+};
+
+// the partition id names in each of images, in the order given(the same image cloned may hold it more than once)
+std::vector<image_partition> find_partition_in_images(const std::vector<std::filesystem::path>& images, const partition_id& id);
+
+#endif // __DISK_IMAGE_H__
@@ -0,0 +1,197 @@
+/*
+ * detect_efi_boot_partition
+ *  EFI variable sources: efivarfs and snapshots of it
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <memory>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <string_view>
+
+#include "efivars.h"
+
+typedef std::shared_ptr<int> auto_fd;
+
+static auto_fd open_fd(const std::filesystem::path& path, int flags)
+{
+    int fd = ::open(path.c_str(), flags | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+    //else
+    return auto_fd(new int(fd), [](int* p) { ::close(*p); delete p; });
+}
+
+std::optional<std::vector<uint8_t>> efivarfs::read(const std::string& name) const
+{
+    auto fd = open_fd(dir_ / name, O_RDONLY);
+    if (!fd) return std::nullopt;
+    //else
+    // efivarfs knows the size(attributes + data) and hands out the whole variable at once
+    struct stat st;
+    size_t size = (fstat(*fd, &st) == 0 && st.st_size > 0)? st.st_size : 65536;
+    std::vector<uint8_t> contents(size);
+    auto r = ::pread(*fd, contents.data(), size, 0);
+    if (r < 0) throw std::runtime_error("Cannot read EFI variable " + name + ": " + strerror(errno));
+    //else
+    contents.resize(r);
+    return contents;
+}
+
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+std::vector<std::string> efivarfs::list() const
+{
+    auto fd = open_fd(dir_, O_RDONLY | O_DIRECTORY);
+    if (!fd) throw std::runtime_error("Cannot open " + dir_.string());
+    //else
+    std::vector<std::string> names;
+    alignas(linux_dirent64) char buf[32768];
+    while (true) {
+        auto n = syscall(SYS_getdents64, *fd, buf, sizeof(buf));
+        if (n < 0) throw std::runtime_error("getdents64() failed on " + dir_.string());
+        //else
+        if (n == 0) break;
+        //else
+        for (long pos = 0; pos < n;) {
+            auto entry = (const linux_dirent64*)(buf + pos);
+            pos += entry->d_reclen;
+            if (entry->d_name[0] == '.') continue;
+            //else
+            names.emplace_back(entry->d_name);
+        }
+    }
+    return names;
+}
+
+static const char snapshot_magic[8] = { 'E', 'F', 'I', 'V', 'A', 'R', 'S', '\0' };
+static const uint32_t snapshot_version = 1;
+static const size_t snapshot_header_size = 16, record_header_size = 32;
+
+static inline uint16_t u16(const uint8_t* p) { return p[0] | p[1] << 8; }
+static inline uint32_t u32(const uint8_t* p) { return u16(p) | (uint32_t)u16(p + 2) << 16; }
+
+efivar_snapshot::efivar_snapshot(const std::filesystem::path& file)
+{
+    auto fd = open_fd(file, O_RDONLY);
+    if (!fd) throw std::runtime_error("Cannot open " + file.string());
+    //else
+    struct stat st;
+    if (fstat(*fd, &st) < 0 || (size_t)st.st_size < snapshot_header_size) throw std::runtime_error(file.string() + " is not an efivars snapshot");
+    //else
+    size_ = st.st_size;
+    auto map = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, *fd, 0);
+    if (map == MAP_FAILED) throw std::runtime_error("Cannot map " + file.string());
+    //else
+    map_ = (const uint8_t*)map;
+    if (memcmp(map_, snapshot_magic, sizeof(snapshot_magic)) != 0 || u32(map_ + 8) != snapshot_version) {
+        munmap(map, size_);
+        throw std::runtime_error(file.string() + " is not an efivars snapshot(or of another version)");
+    }
+    //else
+    auto count = u32(map_ + 12);
+    size_t pos = snapshot_header_size;
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* record = map_ + pos;
+        if (size_ - pos < record_header_size || u32(record) < record_header_size || u32(record) > size_ - pos
+            || record_header_size + (size_t)u16(record + 24) + u32(record + 28) > u32(record)) {
+            munmap(map, size_);
+            throw std::runtime_error(file.string() + ": truncated or corrupt record " + std::to_string(i));
+        }
+        //else
+        std::string name((const char*)record + record_header_size, u16(record + 24));
+        index_.emplace(name + "-" + Guid::from_efi_bytes(record + 8).to_string(), record);
+        pos += u32(record);
+    }
+}
+
+efivar_snapshot::~efivar_snapshot()
+{
+    munmap((void*)map_, size_);
+}
+
+std::optional<std::vector<uint8_t>> efivar_snapshot::read(const std::string& name) const
+{
+    auto i = index_.find(name);
+    if (i == index_.end()) return std::nullopt;
+    //else
+    const uint8_t* record = i->second;
+    const uint8_t* data = record + record_header_size + u16(record + 24);
+    std::vector<uint8_t> contents(4 + u32(record + 28));
+    memcpy(contents.data(), record + 4, 4);     // attributes
+    memcpy(contents.data() + 4, data, contents.size() - 4);
+    return contents;
+}
+
+std::vector<std::string> efivar_snapshot::list() const
+{
+    std::vector<std::string> names;
+    for (const auto& [name, record] : index_) names.push_back(name);
+    return names;
+}
+
+size_t record_efivar_snapshot(const efivar_source& source, const std::filesystem::path& file)
+{
+    auto names = source.list();
+    std::sort(names.begin(), names.end());
+    std::string records;
+    size_t count = 0;
+    for (const auto& name : names) {
+        // "<name>-<GUID>"
+        if (name.size() <= Guid::text_length + 1 || name[name.size() - Guid::text_length - 1] != '-') continue;
+        //else
+        auto guid = parse_guid(std::string_view(name).substr(name.size() - Guid::text_length));
+        if (!guid || (*guid != efi_global_variable_guid && *guid != loader_interface_guid)) continue;
+        //else
+        auto contents = source.read(name);
+        if (!contents || contents->size() < 4) continue;   // vanished meanwhile
+        //else
+        auto var_name = name.substr(0, name.size() - Guid::text_length - 1);
+        uint32_t data_len = contents->size() - 4;
+        uint32_t size = (record_header_size + var_name.size() + data_len + 7) & ~(size_t)7;
+        uint8_t header[record_header_size] = {};
+        auto size_le = htole32(size), data_len_le = htole32(data_len);
+        uint16_t name_len_le = htole16((uint16_t)var_name.size());
+        memcpy(header, &size_le, 4);
+        memcpy(header + 4, contents->data(), 4);    // attributes, already little endian
+        memcpy(header + 8, guid->data(), 16);
+        memcpy(header + 24, &name_len_le, 2);
+        memcpy(header + 28, &data_len_le, 4);
+        records.append((const char*)header, sizeof(header));
+        records += var_name;
+        records.append((const char*)contents->data() + 4, data_len);
+        records.append(size - record_header_size - var_name.size() - data_len, '\0');
+        count++;
+    }
+
+    auto tmp = file;
+    tmp += ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        uint8_t header[snapshot_header_size];
+        auto version_le = htole32(snapshot_version), count_le = htole32((uint32_t)count);
+        memcpy(header, snapshot_magic, 8);
+        memcpy(header + 8, &version_le, 4);
+        memcpy(header + 12, &count_le, 4);
+        out.write((const char*)header, sizeof(header));
+        out.write(records.data(), records.size());
+        if (!out.flush()) throw std::runtime_error("Cannot write " + tmp.string());
+    }
+    std::filesystem::rename(tmp, file);
+    return count;
+}
@@ -0,0 +1,68 @@
+/*
+ * detect_efi_boot_partition
+ *  EFI variable sources: efivarfs and snapshots of it
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __EFIVARS_H__
+#define __EFIVARS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+#include <optional>
+#include <filesystem>
+#include <unordered_map>
+
+#include "guid.h"
+
+// vendor GUIDs of the variables this tool reads
+inline constexpr Guid efi_global_variable_guid = Guid::literal("8be4df61-93ca-11d2-aa0d-00e098032b8c");
+inline constexpr Guid loader_interface_guid = Guid::literal("4a67b082-0a4c-41cf-b6c7-440b29bb8c4f");
+
+// where EFI variables come from. Names are as efivarfs has them: "<name>-<vendor GUID>".
+// Implementations are safe to read from several threads at once.
+class efivar_source {
+public:
+    virtual ~efivar_source() = default;
+    // the attributes(4 bytes, little endian) followed by the data, as efivarfs presents a variable;
+    // std::nullopt when there is no such variable
+    virtual std::optional<std::vector<uint8_t>> read(const std::string& name) const = 0;
+    virtual std::vector<std::string> list() const = 0;
+    // false where only non-volatile variables are kept(a VM's variable store), so BootCurrent can't be there
+    virtual bool has_volatile_variables() const { return true; }
+};
+
+// the running firmware's variables; each read is a single pread()
+class efivarfs : public efivar_source {
+    std::filesystem::path dir_;
+public:
+    efivarfs(const std::filesystem::path& dir = "/sys/firmware/efi/efivars") : dir_(dir) {}
+    std::optional<std::vector<uint8_t>> read(const std::string& name) const override;
+    std::vector<std::string> list() const override;    // one getdents64() pass
+};
+
+// Snapshot file(--record-efivars/--replay-efivars), all integers little endian:
+//   header(16 bytes): "EFIVARS\0", u32 version(1), u32 number of records
+//   record(8 byte aligned): u32 record size(padding included), u32 attributes, vendor GUID(16 bytes, EFI layout),
+//                           u16 name length, u16 reserved(0), u32 data length, name(UTF-8, no NUL), data, padding
+// Records can be walked in place in a mapping of the file, no parsing beyond the length fields needed.
+class efivar_snapshot : public efivar_source {
+    const uint8_t* map_ = nullptr;
+    size_t size_ = 0;
+    std::unordered_map<std::string, const uint8_t*> index_; // name-GUID -> record
+public:
+    explicit efivar_snapshot(const std::filesystem::path& file);   // throws when not a valid snapshot
+    ~efivar_snapshot();
+    efivar_snapshot(const efivar_snapshot&) = delete;
+    efivar_snapshot& operator=(const efivar_snapshot&) = delete;
+    std::optional<std::vector<uint8_t>> read(const std::string& name) const override;
+    std::vector<std::string> list() const override;
+};
+
+// writes the variables of source under the vendor GUIDs above into file(atomically); returns how many
+size_t record_efivar_snapshot(const efivar_source& source, const std::filesystem::path& file);
+
+#endif // __EFIVARS_H__
@@ -0,0 +1,83 @@
+/*
+ * detect_efi_boot_partition
+ *  Listing every EFI System Partition on the host
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <atomic>
+#include <thread>
+#include <algorithm>
+
+#include "esp_scan.h"
+#include "device_reader.h"
+#include "metrics.h"
+#include "json.h"
+
+std::vector<esp_info> scan_all_esps(const resolver_options& options, unsigned int threads)
+{
+    auto devices = block_devices();
+    auto disks = select_disks(devices, options);
+
+    // one slot per disk: workers never contend for anything but the next disk index, and the
+    // result comes out in disk order however the work got spread
+    std::vector<std::vector<esp_info>> found(disks.size());
+    std::atomic<size_t> next = 0;
+    auto worker = [&]() {
+        set_io_priority(options.ioprio);
+        for (size_t i; (i = next++) < disks.size();) {
+            const auto* disk = disks[i];
+            std::optional<partition_table> table;
+            try {
+                device_reader reader(disk->devpath(), options.direct_io);
+                metrics.devices_scanned++;
+                table = read_partition_table(reader);
+                metrics.page_cache_bytes += reader.page_cache_bytes();
+            }
+            catch (const std::runtime_error& e) {
+                trace("skipping ", disk->name, ": ", e.what());   // no medium, permission...
+                continue;
+            }
+            if (!table) continue;
+            //else
+            for (const auto& part : table->partitions) {
+                if (!part.is_esp()) continue;
+                //else
+                auto dev = find_partition(devices, disk->name, part.partno);
+                found[i].push_back({ dev? lift_stacked(devices, dev)->devpath() : std::filesystem::path(),
+                    disk->devpath(), part.id, part.start, part.size });
+            }
+        }
+    };
+
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = (unsigned int)std::min<size_t>(threads, disks.size());
+    trace("reading partition tables of ", disks.size(), " disks on ", threads, " threads");
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < threads; i++) workers.emplace_back(worker);
+    if (threads > 0) worker();  // this thread is one of them
+    for (auto& w : workers) w.join();
+    metrics.page_cache_measured = true;
+
+    std::vector<esp_info> esps;
+    for (auto& per_disk : found) {
+        std::move(per_disk.begin(), per_disk.end(), std::back_inserter(esps));
+    }
+    return esps;
+}
+
+std::string esps_to_json(const std::vector<esp_info>& esps)
+{
+    std::string json = "[";
+    for (size_t i = 0; i < esps.size(); i++) {
+        const auto& esp = esps[i];
+        json += (i? ",\n  " : "\n  ");
+        json += "{\"device\":" + (esp.device.empty()? std::string("null") : json_quote(esp.device.string()))
+            + ",\"partuuid\":" + json_quote(esp.id.to_string())
+            + ",\"start\":" + std::to_string(esp.start)
+            + ",\"size\":" + std::to_string(esp.size)
+            + ",\"disk\":" + json_quote(esp.disk.string())
+            + ",\"boot_current\":" + (esp.boot_current? "true" : "false") + "}";
+    }
+    return json + (esps.empty()? "]" : "\n]");
+}
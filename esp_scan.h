@@ -0,0 +1,34 @@
+/*
+ * detect_efi_boot_partition
+ *  Listing every EFI System Partition on the host
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __ESP_SCAN_H__
+#define __ESP_SCAN_H__
+
+#include <stdint.h>
+
+#include <vector>
+#include <filesystem>
+
+#include "partition_table.h"
+#include "resolver.h"
+
+struct esp_info {
+    std::filesystem::path device;   // top-level partition device(see lift_stacked()); empty if the kernel has none
+    std::filesystem::path disk;
+    partition_id id;
+    uint64_t start; // in bytes
+    uint64_t size;  // in bytes
+    bool boot_current = false;      // the one firmware booted from
+};
+
+// every ESP(GPT type C12A7328-F81F-11D2-BA4B-00A0C93EC93B, MBR type 0xEF) on the disks select_disks() picks,
+// in disk order. Each partition table is read once; disks are spread over up to `threads` workers(0: one per core).
+std::vector<esp_info> scan_all_esps(const resolver_options& options, unsigned int threads = 0);
+
+// as a JSON array, one object per line
+std::string esps_to_json(const std::vector<esp_info>& esps);
+
+#endif // __ESP_SCAN_H__
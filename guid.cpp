@@ -0,0 +1,134 @@
+/*
+ * detect_efi_boot_partition
+ *  16 byte GUID value type: text conversion
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "guid.h"
+
+// Text conversion first puts the bytes in written order, then converts all 16 at once.
+// A GUID is exactly one SSE2 register(baseline on x86-64); wider vectors wouldn't help here.
+
+static inline void to_written_order(const uint8_t* efi, uint8_t* written)
+{
+    written[0] = efi[3]; written[1] = efi[2]; written[2] = efi[1]; written[3] = efi[0];
+    written[4] = efi[5]; written[5] = efi[4];
+    written[6] = efi[7]; written[7] = efi[6];
+    memcpy(written + 8, efi + 8, 8);
+}
+
+// 32 hex digits -> "8-4-4-4-12"
+static inline void insert_dashes(const char* hex, char* out)
+{
+    memcpy(out, hex, 8); out[8] = '-';
+    memcpy(out + 9, hex + 8, 4); out[13] = '-';
+    memcpy(out + 14, hex + 12, 4); out[18] = '-';
+    memcpy(out + 19, hex + 16, 4); out[23] = '-';
+    memcpy(out + 24, hex + 20, 12);
+}
+
+static inline void hex_encode16(const uint8_t* in, char* hex)
+{
+#if defined(__SSE2__)
+    __m128i bytes = _mm_loadu_si128((const __m128i*)in);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+    __m128i lo = _mm_and_si128(bytes, mask);
+    // nibble -> '0'..'9', 'a'..'f': add '0', plus ('a' - '0' - 10) where nibble > 9
+    auto to_ascii = [](__m128i n) {
+        __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10));
+        return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), letters);
+    };
+    hi = to_ascii(hi);
+    lo = to_ascii(lo);
+    _mm_storeu_si128((__m128i*)hex, _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i*)(hex + 16), _mm_unpackhi_epi8(hi, lo));
+#else
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < 16; i++) {
+        hex[i * 2] = digits[in[i] >> 4];
+        hex[i * 2 + 1] = digits[in[i] & 0x0f];
+    }
+#endif
+}
+
+// false when any of the 32 characters is not a hex digit
+static inline bool hex_decode16(const char* hex, uint8_t* out)
+{
+#if defined(__SSE2__)
+    bool ok = true;
+    __m128i nibbles[2];
+    for (int half = 0; half < 2; half++) {
+        __m128i c = _mm_loadu_si128((const __m128i*)(hex + half * 16));
+        __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));   // 'A'..'F' -> 'a'..'f'; digits unaffected
+        __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+        __m128i is_letter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+        if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_letter)) != 0xffff) ok = false;
+        nibbles[half] = _mm_or_si128(
+            _mm_and_si128(is_digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+            _mm_and_si128(is_letter, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+    }
+    if (!ok) return false;
+    //else
+    // even bytes are high nibbles: (hi << 4) | lo within each 16 bit lane, then pack to 8 bit
+    __m128i mask = _mm_set1_epi16(0x00ff);
+    __m128i packed[2];
+    for (int half = 0; half < 2; half++) {
+        __m128i hi = _mm_and_si128(nibbles[half], mask);
+        __m128i lo = _mm_srli_epi16(nibbles[half], 8);
+        packed[half] = _mm_or_si128(_mm_slli_epi16(hi, 4), lo);
+    }
+    _mm_storeu_si128((__m128i*)out, _mm_packus_epi16(packed[0], packed[1]));
+    return true;
+#else
+    auto value = [](char c) {
+        return (c >= '0' && c <= '9')? c - '0' : (c >= 'a' && c <= 'f')? c - 'a' + 10 : (c >= 'A' && c <= 'F')? c - 'A' + 10 : -1;
+    };
+    for (int i = 0; i < 16; i++) {
+        int hi = value(hex[i * 2]), lo = value(hex[i * 2 + 1]);
+        if (hi < 0 || lo < 0) return false;
+        //else
+        out[i] = (uint8_t)(hi << 4 | lo);
+    }
+    return true;
+#endif
+}
+
+void Guid::format(char* out) const
+{
+    uint8_t written[16];
+    char hex[32];
+    to_written_order(bytes_.data(), written);
+    hex_encode16(written, hex);
+    insert_dashes(hex, out);
+}
+
+void format_guids(const Guid* guids, size_t count, char* out)
+{
+    for (size_t i = 0; i < count; i++) {
+        guids[i].format(out + i * Guid::text_length);
+    }
+}
+
+std::optional<Guid> parse_guid(std::string_view text)
+{
+    if (text.size() != Guid::text_length || text[8] != '-' || text[13] != '-' || text[18] != '-' || text[23] != '-') return std::nullopt;
+    //else
+    char hex[32];
+    memcpy(hex, text.data(), 8);
+    memcpy(hex + 8, text.data() + 9, 4);
+    memcpy(hex + 12, text.data() + 14, 4);
+    memcpy(hex + 16, text.data() + 19, 4);
+    memcpy(hex + 20, text.data() + 24, 12);
+    uint8_t written[16];
+    if (!hex_decode16(hex, written)) return std::nullopt;
+    //else
+    uint8_t efi[16];
+    to_written_order(written, efi);     // the reordering is its own inverse
+    return Guid::from_efi_bytes(efi);
+}
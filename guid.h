@@ -0,0 +1,109 @@
+/*
+ * detect_efi_boot_partition
+ *  16 byte GUID value type
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __GUID_H__
+#define __GUID_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <array>
+#include <string>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+
+// A GUID as stored by EFI(partition entries, device paths, variable names): the first three fields
+// little endian, the rest big endian. Kept in that layout; only text conversion reorders bytes.
+class Guid {
+    std::array<uint8_t, 16> bytes_ {};
+
+    // efi_order[i]: index in the stored bytes of the i-th byte as written in text
+    static constexpr uint8_t efi_order[16] = { 3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+    // offset in text of the i-th written byte
+    static constexpr uint8_t text_offset[16] = { 0, 2, 4, 6, 9, 11, 14, 16, 19, 21, 24, 26, 28, 30, 32, 34 };
+
+    static constexpr int hex_value(char c)
+    {
+        return (c >= '0' && c <= '9')? c - '0' : (c >= 'a' && c <= 'f')? c - 'a' + 10 : (c >= 'A' && c <= 'F')? c - 'A' + 10 : -1;
+    }
+public:
+    static constexpr size_t text_length = 36;
+
+    constexpr Guid() = default;
+
+    static Guid from_efi_bytes(const void* src)
+    {
+        Guid guid;
+        memcpy(guid.bytes_.data(), src, 16);
+        return guid;
+    }
+
+    // "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx", either case
+    static constexpr std::optional<Guid> parse(std::string_view text)
+    {
+        if (text.size() != text_length || text[8] != '-' || text[13] != '-' || text[18] != '-' || text[23] != '-') return std::nullopt;
+        //else
+        Guid guid;
+        for (int i = 0; i < 16; i++) {
+            auto hi = hex_value(text[text_offset[i]]), lo = hex_value(text[text_offset[i] + 1]);
+            if (hi < 0 || lo < 0) return std::nullopt;
+            //else
+            guid.bytes_[efi_order[i]] = (uint8_t)(hi << 4 | lo);
+        }
+        return guid;
+    }
+
+    // for literals: a typo is a compile error when used in a constexpr context
+    static constexpr Guid literal(std::string_view text)
+    {
+        auto guid = parse(text);
+        if (!guid) throw std::invalid_argument("malformed GUID literal");
+        return *guid;
+    }
+
+    const uint8_t* data() const { return bytes_.data(); }
+    constexpr bool is_nil() const
+    {
+        for (auto b : bytes_) if (b) return false;
+        return true;
+    }
+
+    // writes text_length lowercase characters(no terminator)
+    void format(char* out) const;
+    std::string to_string() const
+    {
+        std::string text(text_length, '\0');
+        format(text.data());
+        return text;
+    }
+
+    bool operator==(const Guid& other) const { return memcmp(bytes_.data(), other.bytes_.data(), 16) == 0; }
+    bool operator!=(const Guid& other) const { return !(*this == other); }
+    bool operator<(const Guid& other) const { return memcmp(bytes_.data(), other.bytes_.data(), 16) < 0; }
+
+    friend struct GuidHash;
+};
+
+struct GuidHash {
+    size_t operator()(const Guid& guid) const
+    {
+        // random(v4) or time based(v1) GUIDs: both halves carry plenty of entropy
+        uint64_t a, b;
+        memcpy(&a, guid.bytes_.data(), 8);
+        memcpy(&b, guid.bytes_.data() + 8, 8);
+        return a ^ (b * 0x9e3779b97f4a7c15ULL);
+    }
+};
+
+// bulk formatting: count * Guid::text_length characters, no separators
+void format_guids(const Guid* guids, size_t count, char* out);
+
+// runtime parsing, vectorized where available; same result as Guid::parse()
+std::optional<Guid> parse_guid(std::string_view text);
+
+#endif // __GUID_H__
@@ -0,0 +1,89 @@
+/*
+ * detect_efi_boot_partition
+ *  Persistent per-host record: last answer and backend statistics
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <unistd.h>
+#include <sys/sysmacros.h>
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "host_record.h"
+
+static const double ewma_weight = 0.3;  // of the newest measurement
+
+void host_record::record(const std::string& backend, bool success, double seconds)
+{
+    auto& stats = backends[backend];
+    (success? stats.successes : stats.failures)++;
+    stats.mean_seconds = stats.mean_seconds > 0.0? stats.mean_seconds * (1 - ewma_weight) + seconds * ewma_weight : seconds;
+}
+
+// text, one item per line:
+//   answer <partuuid> <major>:<minor> <device>
+//   backend <name> <successes> <failures> <mean seconds>
+host_record host_record::load(const std::filesystem::path& path)
+{
+    host_record record;
+    std::ifstream f(path);
+    std::string line;
+    while (std::getline(f, line)) {
+        std::istringstream in(line);
+        std::string kind;
+        in >> kind;
+        if (kind == "answer") {
+            cached_answer answer;
+            std::string devnum, device;
+            unsigned int major, minor;
+            in >> answer.partuuid >> devnum >> std::ws;
+            std::getline(in, device);
+            if (!in || sscanf(devnum.c_str(), "%u:%u", &major, &minor) != 2 || device.empty()) continue;
+            //else
+            answer.devnum = makedev(major, minor);
+            answer.device = device;
+            record.answer = answer;
+        } else if (kind == "backend") {
+            std::string name;
+            backend_stats stats;
+            in >> name >> stats.successes >> stats.failures >> stats.mean_seconds;
+            if (in) record.backends[name] = stats;
+        }
+    }
+    return record;
+}
+
+void host_record::save(const std::filesystem::path& path) const
+{
+    std::ostringstream out;
+    out << "# detect_efi_boot_partition host record" << std::endl;
+    if (answer) {
+        out << "answer " << answer->partuuid << ' ' << major(answer->devnum) << ':' << minor(answer->devnum)
+            << ' ' << answer->device.string() << std::endl;
+    }
+    for (const auto& [name, stats] : backends) {
+        out << "backend " << name << ' ' << stats.successes << ' ' << stats.failures << ' ' << stats.mean_seconds << std::endl;
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    auto tmp = path;
+    tmp += ".tmp." + std::to_string(getpid());
+    {
+        std::ofstream f(tmp);
+        f << out.str();
+        f.close();
+        if (!f) {
+            std::filesystem::remove(tmp, ec);
+            throw std::runtime_error("Cannot write " + tmp.string());
+        }
+    }
+    std::filesystem::rename(tmp, path, ec);
+    if (ec) {
+        std::filesystem::remove(tmp, ec);
+        throw std::runtime_error("Cannot rename " + tmp.string() + " to " + path.string());
+    }
+}
@@ -0,0 +1,42 @@
+/*
+ * detect_efi_boot_partition
+ *  Persistent per-host record: last answer and backend statistics
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __HOST_RECORD_H__
+#define __HOST_RECORD_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+#include <optional>
+#include <filesystem>
+
+struct backend_stats {
+    uint32_t successes = 0;
+    uint32_t failures = 0;
+    double mean_seconds = 0.0;  // exponentially weighted; 0 = never measured
+};
+
+struct cached_answer {
+    std::string partuuid;
+    dev_t devnum;
+    std::filesystem::path device;
+};
+
+struct host_record {
+    std::optional<cached_answer> answer;
+    std::map<std::string, backend_stats> backends;
+
+    void record(const std::string& backend, bool success, double seconds);
+
+    // empty record when the file is missing or unreadable
+    static host_record load(const std::filesystem::path& path);
+    // temporary file + rename(2); throws on failure
+    void save(const std::filesystem::path& path) const;
+};
+
+#endif // __HOST_RECORD_H__
@@ -0,0 +1,75 @@
+/*
+ * detect_efi_boot_partition
+ *  I/O priority and read rate limiting for block device probing
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/syscall.h>
+
+#include <thread>
+#include <algorithm>
+
+#include "io_throttle.h"
+#include "metrics.h"
+
+// from linux/ioprio.h, which older kernel headers lack
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_VALUE(cls, data) (((cls) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+
+io_budget read_budget;
+
+void set_io_priority(io_priority prio)
+{
+    int value;
+    switch (prio) {
+    case io_priority::best_effort_lowest: value = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7); break;
+    case io_priority::idle: value = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0); break;
+    default: return;
+    }
+    // who == 0 with IOPRIO_WHO_PROCESS means the calling thread
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, value) < 0) {
+        // only a courtesy to other I/O; probing goes on at the inherited priority
+        trace("ioprio_set() failed: ", strerror(errno));
+    }
+}
+
+void io_budget::configure(uint64_t _bytes_per_second, unsigned int _max_outstanding)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    bytes_per_second = _bytes_per_second;
+    max_outstanding = _max_outstanding;
+    next_slot = std::chrono::steady_clock::now();
+}
+
+void io_budget::acquire(size_t bytes)
+{
+    std::chrono::steady_clock::time_point slot;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]() { return max_outstanding == 0 || outstanding < max_outstanding; });
+        outstanding++;
+        if (bytes_per_second == 0) return;
+        //else
+        // each read reserves its share of the timeline; the first one goes immediately
+        slot = std::max(next_slot, std::chrono::steady_clock::now());
+        next_slot = slot + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>((double)bytes / bytes_per_second));
+    }
+    std::this_thread::sleep_until(slot);
+}
+
+void io_budget::release()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        outstanding--;
+    }
+    cv.notify_one();
+}
@@ -0,0 +1,49 @@
+/*
+ * detect_efi_boot_partition
+ *  I/O priority and read rate limiting for block device probing
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __IO_THROTTLE_H__
+#define __IO_THROTTLE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+
+enum class io_priority {
+    none,       // inherit
+    best_effort_lowest, // IOPRIO_CLASS_BE, level 7
+    idle,       // IOPRIO_CLASS_IDLE: served only when nobody else wants the disk
+};
+
+// applies to the calling thread only(every probing thread calls it for itself); best effort, a failure is only traced
+void set_io_priority(io_priority prio);
+
+// Caps reads in flight and read bandwidth across all threads. Unlimited unless configured.
+class io_budget {
+    std::mutex mutex;
+    std::condition_variable cv;
+    unsigned int max_outstanding = 0;   // 0 = unlimited
+    unsigned int outstanding = 0;
+    uint64_t bytes_per_second = 0;      // 0 = unlimited
+    std::chrono::steady_clock::time_point next_slot;
+public:
+    void configure(uint64_t _bytes_per_second, unsigned int _max_outstanding);
+    void acquire(size_t bytes);   // blocks until the read may be issued
+    void release();
+
+    class ticket {
+        io_budget& budget;
+    public:
+        ticket(io_budget& _budget, size_t bytes) : budget(_budget) { budget.acquire(bytes); }
+        ~ticket() { budget.release(); }
+    };
+};
+
+extern io_budget read_budget;
+
+#endif // __IO_THROTTLE_H__
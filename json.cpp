@@ -0,0 +1,139 @@
+/*
+ * detect_efi_boot_partition
+ *  Minimal JSON helpers
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <stdio.h>
+
+#include "json.h"
+#include "utf16.h"
+
+std::string json_quote(std::string_view value)
+{
+    std::string quoted = "\"";
+    for (auto c : value) {
+        if (c == '"') quoted += "\\\"";
+        else if (c == '\\') quoted += "\\\\";
+        else if (c == '\n') quoted += "\\n";
+        else if ((unsigned char)c < 0x20) {
+            char buf[8];
+            sprintf(buf, "\\u%04x", (unsigned char)c);
+            quoted += buf;
+        }
+        else quoted += c;
+    }
+    return quoted + "\"";
+}
+
+static void skip_whitespace(std::string_view text, size_t& pos)
+{
+    while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\r' || text[pos] == '\n')) pos++;
+}
+
+static std::optional<uint32_t> parse_hex4(std::string_view text, size_t& pos)
+{
+    if (text.size() - pos < 4) return std::nullopt;
+    //else
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        auto c = text[pos++] | 0x20;
+        int digit = (c >= '0' && c <= '9')? c - '0' : (c >= 'a' && c <= 'f')? c - 'a' + 10 : -1;
+        if (digit < 0) return std::nullopt;
+        //else
+        value = value << 4 | digit;
+    }
+    return value;
+}
+
+// the string literal at pos(opening quote), advancing pos past its closing quote
+static std::optional<std::string> parse_string(std::string_view text, size_t& pos)
+{
+    if (pos >= text.size() || text[pos] != '"') return std::nullopt;
+    //else
+    pos++;
+    std::string value;
+    while (pos < text.size()) {
+        char c = text[pos++];
+        if (c == '"') return value;
+        //else
+        if ((unsigned char)c < 0x20) return std::nullopt;
+        //else
+        if (c != '\\') { value += c; continue; }
+        //else
+        if (pos >= text.size()) return std::nullopt;
+        //else
+        switch (text[pos++]) {
+        case '"': value += '"'; break;
+        case '\\': value += '\\'; break;
+        case '/': value += '/'; break;
+        case 'b': value += '\b'; break;
+        case 'f': value += '\f'; break;
+        case 'n': value += '\n'; break;
+        case 'r': value += '\r'; break;
+        case 't': value += '\t'; break;
+        case 'u': {
+            auto cp = parse_hex4(text, pos);
+            if (!cp) return std::nullopt;
+            //else
+            if (*cp >= 0xd800 && *cp < 0xdc00) {    // high surrogate; the low one must follow
+                if (text.substr(pos, 2) != "\\u") return std::nullopt;
+                //else
+                pos += 2;
+                auto low = parse_hex4(text, pos);
+                if (!low || *low < 0xdc00 || *low >= 0xe000) return std::nullopt;
+                //else
+                cp = 0x10000 + ((*cp - 0xd800) << 10) + (*low - 0xdc00);
+            } else if (*cp >= 0xdc00 && *cp < 0xe000) {
+                return std::nullopt;
+            }
+            char utf8[4];
+            value.append(utf8, encode_utf8(*cp, utf8));
+            break;
+        }
+        default: return std::nullopt;
+        }
+    }
+    //else
+    return std::nullopt;   // unterminated
+}
+
+std::optional<std::map<std::string, std::string>> parse_json_string_object(std::string_view text)
+{
+    std::map<std::string, std::string> members;
+    size_t pos = 0;
+    skip_whitespace(text, pos);
+    if (pos >= text.size() || text[pos++] != '{') return std::nullopt;
+    //else
+    skip_whitespace(text, pos);
+    if (pos < text.size() && text[pos] == '}') {
+        pos++;
+    } else {
+        while (true) {
+            skip_whitespace(text, pos);
+            auto key = parse_string(text, pos);
+            if (!key) return std::nullopt;
+            //else
+            skip_whitespace(text, pos);
+            if (pos >= text.size() || text[pos++] != ':') return std::nullopt;
+            //else
+            skip_whitespace(text, pos);
+            auto value = parse_string(text, pos);
+            if (!value) return std::nullopt;
+            //else
+            members[*key] = std::move(*value);
+            skip_whitespace(text, pos);
+            if (pos >= text.size()) return std::nullopt;
+            //else
+            auto c = text[pos++];
+            if (c == '}') break;
+            //else
+            if (c != ',') return std::nullopt;
+        }
+    }
+    skip_whitespace(text, pos);
+    if (pos != text.size()) return std::nullopt;
+    //else
+    return members;
+}
@@ -0,0 +1,22 @@
+/*
+ * detect_efi_boot_partition
+ *  Minimal JSON helpers
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __JSON_H__
+#define __JSON_H__
+
+#include <map>
+#include <string>
+#include <optional>
+#include <string_view>
+
+// value as a JSON string literal, quotes included
+std::string json_quote(std::string_view value);
+
+// members of a JSON object whose values are all strings(e.g. a --batch manifest line);
+// std::nullopt if text is anything else
+std::optional<std::map<std::string, std::string>> parse_json_string_object(std::string_view text);
+
+#endif // __JSON_H__
@@ -0,0 +1,158 @@
+/*
+ * detect_efi_boot_partition
+ *  Run statistics, tracing and OpenMetrics textfile export
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+
+#include "metrics.h"
+
+Metrics metrics;
+bool trace_enabled = false;
+std::mutex trace_mutex;
+
+const char* to_string(failure_reason reason)
+{
+    switch (reason) {
+    case failure_reason::none: return "none";
+    case failure_reason::no_efivars: return "no_efivars";
+    case failure_reason::no_boot_option: return "no_boot_option";
+    case failure_reason::truncated_variable: return "truncated_variable";
+    case failure_reason::invalid_device_path: return "invalid_device_path";
+    case failure_reason::no_harddrive_node: return "no_harddrive_node";
+    case failure_reason::partition_not_found: return "partition_not_found";
+    case failure_reason::deadline_exceeded: return "deadline_exceeded";
+    case failure_reason::probe_error: return "probe_error";
+    case failure_reason::device_io_forbidden: return "device_io_forbidden";
+    case failure_reason::no_loader_path: return "no_loader_path";
+    case failure_reason::esp_not_mounted: return "esp_not_mounted";
+    case failure_reason::internal: return "internal";
+    }
+    //else
+    return "unknown";
+}
+
+static std::mutex phase_mutex;   // --batch runs phases on several threads at once
+
+phase_timer::~phase_timer()
+{
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::lock_guard<std::mutex> lock(phase_mutex);
+    for (auto& [name, seconds] : metrics.phase_seconds) {
+        if (name == phase) { seconds += elapsed.count(); return; }
+    }
+    //else
+    metrics.phase_seconds.emplace_back(phase, elapsed.count());
+}
+
+std::optional<uint64_t> storage_bytes_read()
+{
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    uint64_t value;
+    while (io >> key >> value) {
+        if (key == "read_bytes:") return value;
+    }
+    //else
+    return {};
+}
+
+static std::string escape_label(const std::string& value)
+{
+    std::string escaped;
+    for (auto c : value) {
+        if (c == '\\') escaped += "\\\\";
+        else if (c == '"') escaped += "\\\"";
+        else if (c == '\n') escaped += "\\n";
+        else escaped += c;
+    }
+    return escaped;
+}
+
+void Metrics::write(const std::filesystem::path& path) const
+{
+    static const char* prefix = "detect_efi_boot_partition_";
+    std::ostringstream out;
+
+    out << "# TYPE " << prefix << "info gauge\n"
+        << "# HELP " << prefix << "info Resolved EFI boot partition\n"
+        << prefix << "info{device=\"" << escape_label(device) << "\",partuuid=\"" << escape_label(partuuid)
+        << "\",backend=\"" << escape_label(backend) << "\"} 1\n";
+
+    out << "# TYPE " << prefix << "success gauge\n"
+        << prefix << "success " << (failure == failure_reason::none? 1 : 0) << '\n';
+
+    out << "# TYPE " << prefix << "failure gauge\n"
+        << "# HELP " << prefix << "failure Reason code of a failed detection\n"
+        << prefix << "failure{reason=\"" << to_string(failure) << "\"} " << (failure == failure_reason::none? 0 : 1) << '\n';
+
+    out << "# TYPE " << prefix << "phase_duration_seconds gauge\n"
+        << "# UNIT " << prefix << "phase_duration_seconds seconds\n";
+    for (const auto& [phase, seconds] : phase_seconds) {
+        out << prefix << "phase_duration_seconds{phase=\"" << escape_label(phase) << "\"} " << seconds << '\n';
+    }
+
+    out << "# TYPE " << prefix << "backend_duration_seconds gauge\n"
+        << "# UNIT " << prefix << "backend_duration_seconds seconds\n"
+        << "# HELP " << prefix << "backend_duration_seconds Time spent in each resolver backend tried\n";
+    for (const auto& [name, seconds] : backend_seconds) {
+        out << prefix << "backend_duration_seconds{backend=\"" << escape_label(name) << "\",answered=\""
+            << (name == backend? 1 : 0) << "\"} " << seconds << '\n';
+    }
+
+    out << "# TYPE " << prefix << "backend_disagreements gauge\n"
+        << "# HELP " << prefix << "backend_disagreements Backends whose answer differed from the winner(--cross-check)\n"
+        << prefix << "backend_disagreements " << disagreements.size() << '\n';
+
+    out << "# TYPE " << prefix << "devices_scanned gauge\n"
+        << prefix << "devices_scanned " << devices_scanned.load() << '\n'
+        << "# TYPE " << prefix << "devices_excluded gauge\n"
+        << prefix << "devices_excluded " << devices_excluded.load() << '\n'
+        << "# TYPE " << prefix << "device_opens gauge\n"
+        << prefix << "device_opens " << device_opens << '\n';
+
+    if (bytes_read) {
+        out << "# TYPE " << prefix << "read_bytes gauge\n"
+            << "# UNIT " << prefix << "read_bytes bytes\n"
+            << prefix << "read_bytes " << *bytes_read << '\n';
+    }
+
+    if (page_cache_measured) {
+        out << "# TYPE " << prefix << "page_cache_bytes gauge\n"
+            << "# UNIT " << prefix << "page_cache_bytes bytes\n"
+            << "# HELP " << prefix << "page_cache_bytes Bytes pulled into the page cache(dropped again afterwards)\n"
+            << prefix << "page_cache_bytes " << page_cache_bytes.load() << '\n';
+    }
+
+    out << "# TYPE " << prefix << "cache_hit gauge\n"
+        << prefix << "cache_hit " << (cache_hit? 1 : 0) << '\n';
+
+    if (!cache_tier.empty()) {
+        out << "# TYPE " << prefix << "cache_tier gauge\n"
+            << "# HELP " << prefix << "cache_tier blkid cache tier which answered\n"
+            << prefix << "cache_tier{tier=\"" << escape_label(cache_tier) << "\"} 1\n";
+    }
+    out << "# EOF\n";
+
+    // node_exporter must never see a half written file
+    auto tmp = path;
+    tmp += ".tmp." + std::to_string(getpid());
+    {
+        std::ofstream f(tmp);
+        if (!f) throw std::runtime_error("Cannot create metrics file " + tmp.string());
+        f << out.str();
+        f.close();
+        if (!f) throw std::runtime_error("Cannot write metrics file " + tmp.string());
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    if (ec) {
+        std::filesystem::remove(tmp, ec);
+        throw std::runtime_error("Cannot rename metrics file to " + path.string());
+    }
+}
@@ -0,0 +1,102 @@
+/*
+ * detect_efi_boot_partition
+ *  Run statistics, tracing and OpenMetrics textfile export
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <optional>
+#include <stdexcept>
+#include <filesystem>
+
+enum class failure_reason {
+    none,
+    no_efivars,             // efivarfs not mounted / not booted via EFI
+    no_boot_option,         // BootCurrent or Boot#### not readable
+    truncated_variable,     // variable shorter than its structure claims
+    invalid_device_path,    // malformed device path node
+    no_harddrive_node,      // device path has no MEDIA_HARDDRIVE_DP node
+    partition_not_found,    // PARTUUID not present on any device
+    deadline_exceeded,      // --deadline expired
+    probe_error,            // partition search backend failed
+    device_io_forbidden,    // answer needs block device I/O but --no-device-io is in effect
+    no_loader_path,         // --loader: boot option has no MEDIA_FILEPATH_DP node
+    esp_not_mounted,        // --loader: ESP found but not mounted
+    internal,               // anything else
+};
+
+const char* to_string(failure_reason reason);
+
+// runtime_error carrying a machine readable reason for the metrics file
+class detection_error : public std::runtime_error {
+    failure_reason reason_;
+public:
+    detection_error(failure_reason reason, const std::string& what) : std::runtime_error(what), reason_(reason) {}
+    failure_reason reason() const { return reason_; }
+};
+
+struct Metrics {
+    std::string device;     // resolved ESP(empty on failure)
+    std::string partuuid;
+    std::string backend;    // resolver backend which answered
+    std::vector<std::pair<std::string, double>> phase_seconds;  // in execution order
+    std::vector<std::pair<std::string, double>> backend_seconds;    // backends tried, in chain order
+    std::vector<std::string> disagreements; // "backend=device" answers differing from the winner(--cross-check)
+    // counters below are updated by concurrently running backends(--race)
+    std::atomic<uint64_t> devices_scanned = 0;
+    std::atomic<uint64_t> devices_excluded = 0;  // skipped by the device filter without being opened
+    uint64_t device_opens = 0;      // block devices opened(0 is guaranteed with --no-device-io)
+    std::optional<uint64_t> bytes_read;     // storage bytes read during the run(/proc/self/io)
+    std::atomic<uint64_t> page_cache_bytes = 0; // bytes the native scanner pulled into the page cache
+    std::atomic<bool> page_cache_measured = false;
+    bool cache_hit = false;
+    std::string cache_tier; // which blkid cache tier answered(verify, probe_all_new, probe_all)
+    failure_reason failure = failure_reason::none;
+
+    // progress, readable from another thread while detection is still running(--deadline)
+    std::atomic<int> boot_current = -1;
+    std::atomic<bool> partuuid_known = false;   // partuuid is set and won't change anymore
+    std::atomic<const char*> current_phase = "start";
+
+    // writes OpenMetrics text to a temporary file next to path, then rename(2)s it over path
+    void write(const std::filesystem::path& path) const;
+};
+
+extern Metrics metrics;
+
+// accumulates wall clock time spent in its scope into metrics.phase_seconds
+class phase_timer {
+    const char* phase;
+    std::chrono::steady_clock::time_point start;
+public:
+    phase_timer(const char* _phase) : phase(_phase), start(std::chrono::steady_clock::now()) { metrics.current_phase = phase; }
+    ~phase_timer();
+};
+
+extern bool trace_enabled;
+extern std::mutex trace_mutex;
+
+// diagnostic output to stderr with --trace
+template <typename... Args> void trace(const Args&... args)
+{
+    if (!trace_enabled) return;
+    //else
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    std::cerr << "trace: ";
+    (std::cerr << ... << args) << std::endl;
+}
+
+// read_bytes of /proc/self/io, if the kernel has task I/O accounting
+std::optional<uint64_t> storage_bytes_read();
+
+#endif // __METRICS_H__
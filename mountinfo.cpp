@@ -0,0 +1,107 @@
+/*
+ * detect_efi_boot_partition
+ *  /proc/self/mountinfo lookup
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+
+#include <memory>
+#include <string_view>
+
+#include "mountinfo.h"
+
+// next space separated field of line, advancing it
+static std::string_view next_field(std::string_view& line)
+{
+    auto end = line.find(' ');
+    auto field = line.substr(0, end);
+    line.remove_prefix(end == line.npos? line.size() : end + 1);
+    return field;
+}
+
+static bool parse_uint(std::string_view s, unsigned int& value)
+{
+    if (s.empty()) return false;
+    //else
+    value = 0;
+    for (auto c : s) {
+        if (c < '0' || c > '9') return false;
+        //else
+        value = value * 10 + (c - '0');
+    }
+    return true;
+}
+
+// mountinfo escapes space, tab, newline and backslash as \ooo
+static std::string unescape(std::string_view s)
+{
+    std::string unescaped;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '\\' && i + 3 < s.size() && s[i + 1] >= '0' && s[i + 1] <= '3') {
+            unescaped += (char)((s[i + 1] - '0') << 6 | (s[i + 2] - '0') << 3 | (s[i + 3] - '0'));
+            i += 3;
+        } else {
+            unescaped += s[i];
+        }
+    }
+    return unescaped;
+}
+
+// "36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw" -> "/mnt2" when 98:0 matches and root is "/"
+static std::optional<std::filesystem::path> match_line(std::string_view line, unsigned int major_, unsigned int minor_)
+{
+    next_field(line);   // mount ID
+    next_field(line);   // parent ID
+    auto devnum = next_field(line);
+    auto colon = devnum.find(':');
+    unsigned int ma, mi;
+    if (colon == devnum.npos || !parse_uint(devnum.substr(0, colon), ma) || !parse_uint(devnum.substr(colon + 1), mi)) return {};
+    //else
+    if (ma != major_ || mi != minor_) return {};
+    //else
+    if (next_field(line) != "/") return {};   // bind mount of a subdirectory
+    //else
+    return std::filesystem::path(unescape(next_field(line)));
+}
+
+std::optional<std::filesystem::path> find_mountpoint(dev_t devnum, const char* mountinfo)
+{
+    std::shared_ptr<int> fd(new int(::open(mountinfo, O_RDONLY | O_CLOEXEC)), [](int* p) { if (*p >= 0) ::close(*p); delete p; });
+    if (*fd < 0) return {};
+    //else
+    auto ma = major(devnum), mi = minor(devnum);
+    char buf[16384];
+    size_t filled = 0;
+    bool skipping = false;  // in the middle of a line longer than buf; can't be a mount worth matching
+    while (true) {
+        auto r = ::read(*fd, buf + filled, sizeof(buf) - filled);
+        if (r < 0) return {};
+        //else
+        filled += r;
+        size_t pos = 0;
+        while (true) {
+            auto nl = (const char*)memchr(buf + pos, '\n', filled - pos);
+            if (!nl) break;
+            //else
+            std::string_view line(buf + pos, nl - (buf + pos));
+            pos = nl - buf + 1;
+            if (skipping) { skipping = false; continue; }
+            //else
+            if (auto found = match_line(line, ma, mi)) return found;
+        }
+        if (r == 0) {   // EOF; a last line without newline
+            if (!skipping && pos < filled) return match_line(std::string_view(buf + pos, filled - pos), ma, mi);
+            //else
+            return {};
+        }
+        //else
+        memmove(buf, buf + pos, filled - pos);
+        filled -= pos;
+        if (filled == sizeof(buf)) { filled = 0; skipping = true; }
+    }
+}
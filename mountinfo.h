@@ -0,0 +1,19 @@
+/*
+ * detect_efi_boot_partition
+ *  /proc/self/mountinfo lookup
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __MOUNTINFO_H__
+#define __MOUNTINFO_H__
+
+#include <sys/types.h>
+
+#include <optional>
+#include <filesystem>
+
+// where the filesystem on devnum is mounted with its root(not a bind mount of a subdirectory), first one listed.
+// Matched by major:minor in a single pass over the file, without parsing the lines that don't match.
+std::optional<std::filesystem::path> find_mountpoint(dev_t devnum, const char* mountinfo = "/proc/self/mountinfo");
+
+#endif // __MOUNTINFO_H__
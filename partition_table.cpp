@@ -0,0 +1,283 @@
+/*
+ * detect_efi_boot_partition
+ *  Native GPT/MBR partition table reader
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <endian.h>
+#include <string.h>
+
+#include <memory>
+#include <stdexcept>
+
+#include "partition_table.h"
+#include "crc32.h"
+#include "metrics.h"
+
+struct __attribute__((packed)) mbr_partition_t {
+    uint8_t status;
+    uint8_t chs_first[3];
+    uint8_t type;
+    uint8_t chs_last[3];
+    uint32_t lba_start;
+    uint32_t lba_count;
+};
+
+struct __attribute__((packed)) mbr_t {
+    uint8_t bootstrap[440];
+    uint32_t disk_signature;
+    uint16_t reserved;
+    mbr_partition_t partitions[4];
+    uint8_t boot_signature[2];
+};
+static_assert(sizeof(mbr_t) == 512);
+
+struct __attribute__((packed)) gpt_header_t {
+    char signature[8];
+    uint32_t revision;
+    uint32_t header_size;
+    uint32_t header_crc32;
+    uint32_t reserved;
+    uint64_t my_lba;
+    uint64_t alternate_lba;
+    uint64_t first_usable_lba;
+    uint64_t last_usable_lba;
+    uint8_t disk_guid[16];
+    uint64_t partition_entry_lba;
+    uint32_t num_partition_entries;
+    uint32_t partition_entry_size;
+    uint32_t partition_entry_array_crc32;
+};
+static_assert(sizeof(gpt_header_t) == 92);
+
+struct __attribute__((packed)) gpt_entry_t {
+    uint8_t type_guid[16];
+    uint8_t unique_guid[16];
+    uint64_t first_lba;
+    uint64_t last_lba;
+    uint64_t attributes;
+    uint16_t name[36];
+};
+static_assert(sizeof(gpt_entry_t) == 128);
+
+static const size_t max_entry_array_size = 1024 * 1024;    // way beyond anything sane(usually 16KiB)
+static const int max_logical_partitions = 256;
+
+std::string partition_id::to_string() const
+{
+    if (!is_mbr()) return guid.to_string();
+    //else
+    char buf[20];
+    sprintf(buf, "%08x-%02x", mbr_signature, mbr_partno);
+    return buf;
+}
+
+std::optional<partition_id> partition_id::parse(std::string_view partuuid)
+{
+    if (partuuid.size() == Guid::text_length) {
+        auto guid = parse_guid(partuuid);
+        if (!guid) return std::nullopt;
+        //else
+        return partition_id::gpt(*guid);
+    }
+    //else
+    if (partuuid.size() < 11 || partuuid.size() > 16 || partuuid[8] != '-') return std::nullopt;
+    //else
+    uint32_t signature = 0, partno = 0;
+    for (size_t i = 0; i < partuuid.size(); i++) {
+        if (i == 8) continue;
+        //else
+        auto c = partuuid[i] | 0x20;
+        int digit = (c >= '0' && c <= '9')? c - '0' : (c >= 'a' && c <= 'f')? c - 'a' + 10 : -1;
+        if (digit < 0) return std::nullopt;
+        //else
+        if (i < 8) signature = signature << 4 | digit;
+        else partno = partno << 4 | digit;
+    }
+    if (partno == 0) return std::nullopt;
+    //else
+    return partition_id::mbr(signature, partno);
+}
+
+static bool is_extended(uint8_t type) { return type == 0x05 || type == 0x0f || type == 0x85; }
+
+// size bytes at offset: in place if the reader has them mapped, read into storage otherwise
+static const uint8_t* fetch(block_reader& reader, std::unique_ptr<uint8_t[]>& storage, size_t size, uint64_t offset)
+{
+    if (auto p = reader.view(offset, size)) return p;
+    //else
+    storage.reset(new uint8_t[size]);
+    reader.pread(storage.get(), size, offset);
+    return storage.get();
+}
+
+struct gpt_t {
+    gpt_header_t header;
+    const uint8_t* entries;
+    std::unique_ptr<uint8_t[]> entries_storage;    // unless entries point into the reader's mapping
+};
+
+// the GPT header at lba and its entry array, if they pass the checks of UEFI spec 5.3.2:
+// signature, header CRC32, MyLBA, usable range and entry array within the disk, entry array CRC32
+static std::optional<gpt_t> read_gpt_at(block_reader& reader, uint64_t lba, uint64_t last_lba, const char*& why)
+{
+    auto sector_size = reader.sector_size();
+    std::unique_ptr<uint8_t[]> sector_storage;
+    auto sector = fetch(reader, sector_storage, sector_size, lba * sector_size);
+    gpt_t gpt;
+    auto& header = gpt.header;
+    memcpy(&header, sector, sizeof(header));
+    if (memcmp(header.signature, "EFI PART", 8) != 0) { why = "no signature"; return {}; }
+    //else
+    auto header_size = le32toh(header.header_size);
+    if (header_size < sizeof(gpt_header_t) || header_size > sector_size) { why = "bad header size"; return {}; }
+    //else
+    // CRC32 over the header with its CRC field taken as zero; the sector may be read-only
+    static const uint8_t zero_crc[sizeof(header.header_crc32)] = {};
+    auto crc_offset = offsetof(gpt_header_t, header_crc32), crc_end = crc_offset + sizeof(zero_crc);
+    auto crc = crc32_ieee(sector, crc_offset);
+    crc = crc32_ieee(zero_crc, sizeof(zero_crc), crc);
+    crc = crc32_ieee(sector + crc_end, header_size - crc_end, crc);
+    if (crc != le32toh(header.header_crc32)) { why = "header CRC mismatch"; return {}; }
+    //else
+    if (le64toh(header.my_lba) != lba) { why = "MyLBA mismatch"; return {}; }
+    //else
+    auto first_usable = le64toh(header.first_usable_lba), last_usable = le64toh(header.last_usable_lba);
+    if (first_usable > last_usable || last_usable > last_lba) { why = "usable range beyond the disk"; return {}; }
+    //else
+    auto entry_size = le32toh(header.partition_entry_size);
+    auto num_entries = le32toh(header.num_partition_entries);
+    if (entry_size < sizeof(gpt_entry_t) || entry_size % 8 != 0
+        || (uint64_t)entry_size * num_entries > max_entry_array_size) { why = "bad entry array size"; return {}; }
+    //else
+    size_t array_size = (size_t)entry_size * num_entries;
+    auto entry_lba = le64toh(header.partition_entry_lba);
+    if (entry_lba < 2 || entry_lba > last_lba || (array_size + sector_size - 1) / sector_size > last_lba - entry_lba + 1) {
+        why = "entry array beyond the disk";
+        return {};
+    }
+    //else
+    gpt.entries = fetch(reader, gpt.entries_storage, array_size, entry_lba * sector_size);
+    if (crc32_ieee(gpt.entries, array_size) != le32toh(header.partition_entry_array_crc32)) { why = "entry array CRC mismatch"; return {}; }
+    //else
+    return gpt;
+}
+
+static std::optional<partition_table> read_gpt(block_reader& reader)
+{
+    auto sector_size = reader.sector_size();
+    auto disk_last_lba = reader.size() / sector_size - 1;
+    bool from_backup = false;
+    const char* why = nullptr;
+    auto gpt = read_gpt_at(reader, 1, disk_last_lba, why);
+    if (gpt) {
+        auto alternate_lba = le64toh(gpt->header.alternate_lba);
+        // the primary is CRC-valid, which is all the kernel asks for either: a misplaced backup is only worth a note
+        if (alternate_lba > disk_last_lba) trace("GPT: backup header at LBA ", alternate_lba, " is beyond the end of the disk(truncated?)");
+        else if (alternate_lba != disk_last_lba) trace("GPT: backup header at LBA ", alternate_lba, " is not at the end of the disk(grown?)");
+    } else {
+        // damaged primary: the backup header lives at the last LBA and points back at LBA 1
+        auto primary_why = why;
+        gpt = read_gpt_at(reader, disk_last_lba, disk_last_lba, why);
+        if (gpt && le64toh(gpt->header.alternate_lba) != 1) why = "AlternateLBA doesn't point at the primary";
+        if (!gpt || le64toh(gpt->header.alternate_lba) != 1) {
+            trace("GPT: primary header invalid(", primary_why, "), backup header invalid(", why, ")");
+            return {};
+        }
+        //else
+        trace("GPT: primary header invalid(", primary_why, "), using the backup header");
+        from_backup = true;
+    }
+    const auto& header = gpt->header;
+    auto entry_size = le32toh(header.partition_entry_size);
+    auto num_entries = le32toh(header.num_partition_entries);
+
+    partition_table table;
+    table.scheme = partition_table::scheme_t::gpt;
+    table.disk_guid = Guid::from_efi_bytes(header.disk_guid);
+    table.from_backup = from_backup;
+    static const uint8_t unused[16] = {};
+    for (uint32_t i = 0; i < num_entries; i++) {
+        const auto& entry = *(const gpt_entry_t*)(gpt->entries + (size_t)i * entry_size);    // packed: any alignment
+        if (memcmp(entry.type_guid, unused, sizeof(unused)) == 0) continue;
+        //else
+        auto first_lba = le64toh(entry.first_lba), last_lba = le64toh(entry.last_lba);
+        if (last_lba < first_lba) continue;
+        //else
+        partition_entry part;
+        part.partno = i + 1;
+        part.id = partition_id::gpt(Guid::from_efi_bytes(entry.unique_guid));
+        part.start = first_lba * sector_size;
+        part.size = (last_lba - first_lba + 1) * sector_size;
+        part.type_guid = Guid::from_efi_bytes(entry.type_guid);
+        table.partitions.push_back(std::move(part));
+    }
+    return table;
+}
+
+static void read_logical_partitions(block_reader& reader, partition_table& table,
+    uint32_t disk_signature, uint64_t extended_start)
+{
+    auto sector_size = reader.sector_size();
+    uint64_t ebr_lba = extended_start;
+    for (int partno = 5; partno < 5 + max_logical_partitions; partno++) {
+        std::unique_ptr<uint8_t[]> storage;
+        const auto& ebr = *(const mbr_t*)fetch(reader, storage, sizeof(mbr_t), ebr_lba * sector_size);
+        if (ebr.boot_signature[0] != 0x55 || ebr.boot_signature[1] != 0xaa) return;
+        //else
+        const auto& logical = ebr.partitions[0];
+        if (logical.type != 0 && le32toh(logical.lba_count) > 0) {
+            partition_entry part;
+            part.partno = partno;
+            part.id = partition_id::mbr(disk_signature, partno);
+            part.start = (ebr_lba + le32toh(logical.lba_start)) * sector_size;
+            part.size = (uint64_t)le32toh(logical.lba_count) * sector_size;
+            part.mbr_type = logical.type;
+            table.partitions.push_back(std::move(part));
+        }
+        const auto& next = ebr.partitions[1];
+        if (!is_extended(next.type) || le32toh(next.lba_start) == 0) return;
+        //else
+        ebr_lba = extended_start + le32toh(next.lba_start);
+    }
+}
+
+std::optional<partition_table> read_partition_table(block_reader& reader)
+{
+    if (reader.size() < (uint64_t)reader.sector_size() * 2) return {};
+    //else
+    std::unique_ptr<uint8_t[]> storage;
+    const auto& mbr = *(const mbr_t*)fetch(reader, storage, sizeof(mbr_t), 0);
+    if (mbr.boot_signature[0] != 0x55 || mbr.boot_signature[1] != 0xaa) {
+        return read_gpt(reader);    // no(protective) MBR at all: non-compliant, but seen in the wild
+    }
+    //else
+    for (const auto& p : mbr.partitions) {
+        if (p.type == 0xee/*GPT protective*/) return read_gpt(reader);
+    }
+    //else
+    partition_table table;
+    table.scheme = partition_table::scheme_t::mbr;
+    auto disk_signature = le32toh(mbr.disk_signature);
+    table.disk_signature = disk_signature;
+    auto sector_size = reader.sector_size();
+    for (int i = 0; i < 4; i++) {
+        const auto& p = mbr.partitions[i];
+        if (p.type == 0 || le32toh(p.lba_count) == 0) continue;
+        //else
+        if (p.status != 0x00 && p.status != 0x80) return {};   // not an MBR(e.g. FAT boot sector)
+        //else
+        partition_entry part;
+        part.partno = i + 1;
+        part.id = partition_id::mbr(disk_signature, part.partno);
+        part.start = (uint64_t)le32toh(p.lba_start) * sector_size;
+        part.size = (uint64_t)le32toh(p.lba_count) * sector_size;
+        part.mbr_type = p.type;
+        table.partitions.push_back(std::move(part));
+        if (is_extended(p.type)) read_logical_partitions(reader, table, disk_signature, le32toh(p.lba_start));
+    }
+    return table;
+}
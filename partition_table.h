@@ -0,0 +1,80 @@
+/*
+ * detect_efi_boot_partition
+ *  Native GPT/MBR partition table reader
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __PARTITION_TABLE_H__
+#define __PARTITION_TABLE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+#include <optional>
+#include <string_view>
+
+#include "guid.h"
+
+// random access source of disk contents(block device, image file...)
+class block_reader {
+public:
+    virtual ~block_reader() = default;
+    virtual void pread(void* buf, size_t size, uint64_t offset) = 0;   // throws on short read
+    virtual uint64_t size() const = 0;  // in bytes
+    virtual unsigned int sector_size() const { return 512; }    // logical block size
+    // size bytes at offset in place, for readers which have the contents mapped; nullptr means "use pread()"
+    virtual const uint8_t* view(uint64_t /*offset*/, size_t /*size*/) { return nullptr; }
+};
+
+// what libblkid calls PARTUUID, kept binary so that matching never formats strings:
+// the unique partition GUID(GPT), or the disk signature and partition number(MBR)
+struct partition_id {
+    Guid guid;                      // GPT
+    uint32_t mbr_signature = 0;     // MBR
+    uint32_t mbr_partno = 0;        // MBR; 0 for GPT
+
+    static partition_id gpt(const Guid& guid) { return { guid, 0, 0 }; }
+    static partition_id mbr(uint32_t signature, uint32_t partno) { return { Guid(), signature, partno }; }
+    bool is_mbr() const { return mbr_partno != 0; }
+
+    // "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx" or "xxxxxxxx-NN"(partition number in hex), as libblkid formats them
+    std::string to_string() const;
+    static std::optional<partition_id> parse(std::string_view partuuid);
+
+    bool operator==(const partition_id& other) const
+    {
+        return is_mbr()? (mbr_signature == other.mbr_signature && mbr_partno == other.mbr_partno)
+            : (!other.is_mbr() && guid == other.guid);
+    }
+    bool operator!=(const partition_id& other) const { return !(*this == other); }
+};
+
+// EFI System Partition type
+inline constexpr Guid esp_type_guid = Guid::literal("c12a7328-f81f-11d2-ba4b-00a0c93ec93b");
+inline constexpr uint8_t esp_mbr_type = 0xef;
+
+struct partition_entry {
+    int partno;
+    partition_id id;
+    uint64_t start; // in bytes
+    uint64_t size;  // in bytes
+    Guid type_guid;         // GPT only
+    uint8_t mbr_type = 0;   // MBR only
+
+    bool is_esp() const { return id.is_mbr()? mbr_type == esp_mbr_type : type_guid == esp_type_guid; }
+};
+
+struct partition_table {
+    enum class scheme_t { gpt, mbr } scheme;
+    Guid disk_guid;                 // GPT only
+    uint32_t disk_signature = 0;    // MBR only
+    bool from_backup = false;       // GPT primary header or entry array damaged; the backup was used
+    std::vector<partition_entry> partitions;
+};
+
+// std::nullopt when the device carries no(recognizable) partition table
+std::optional<partition_table> read_partition_table(block_reader& reader);
+
+#endif // __PARTITION_TABLE_H__
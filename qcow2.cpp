@@ -0,0 +1,272 @@
+/*
+ * detect_efi_boot_partition
+ *  Read-only qcow2 image reader
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <endian.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "qcow2.h"
+#include "disk_image.h"
+#include "metrics.h"
+
+// qcow2 header(QEMU docs/interop/qcow2.txt), all integers big endian; version 3 adds the fields from
+// incompatible_features on
+struct __attribute__((packed)) qcow2_header_t {
+    uint8_t magic[4];
+    uint32_t version;
+    uint64_t backing_file_offset;
+    uint32_t backing_file_size;
+    uint32_t cluster_bits;
+    uint64_t size;
+    uint32_t crypt_method;
+    uint32_t l1_size;
+    uint64_t l1_table_offset;
+    uint64_t refcount_table_offset;
+    uint32_t refcount_table_clusters;
+    uint32_t nb_snapshots;
+    uint64_t snapshots_offset;
+    // version 3
+    uint64_t incompatible_features;
+    uint64_t compatible_features;
+    uint64_t autoclear_features;
+    uint32_t refcount_order;
+    uint32_t header_length;
+    uint8_t compression_type;   // only if header_length > 104
+};
+static const size_t qcow2_v2_header_size = 72, qcow2_v3_header_size = 104;
+
+static const uint8_t qcow2_magic[4] = { 'Q', 'F', 'I', 0xfb };
+
+// incompatible features
+static const uint64_t incompat_dirty = 1 << 0;          // refcounts may be off: harmless to a reader
+static const uint64_t incompat_corrupt = 1 << 1;
+static const uint64_t incompat_compression_type = 1 << 3;   // compression_type is set(and may be zstd)
+static const uint64_t incompat_understood = incompat_dirty | incompat_corrupt | incompat_compression_type;
+
+static const uint64_t l1_offset_mask = 0x00fffffffffffe00ULL;
+static const uint64_t l2_offset_mask = 0x00fffffffffffe00ULL;
+static const uint64_t l2_compressed = 1ULL << 62;
+static const uint64_t l2_zero = 1ULL << 0;  // version 3: reads as zeros
+
+static const size_t l2_cache_tables = 8;
+static const uint32_t max_l1_size = 32 * 1024 * 1024 / sizeof(uint64_t);   // as QEMU caps it
+
+bool qcow2_reader::is_qcow2(const uint8_t* magic)
+{
+    return memcmp(magic, qcow2_magic, sizeof(qcow2_magic)) == 0;
+}
+
+// relative to the directory of the image referring to it, as QEMU resolves it
+static std::filesystem::path resolve_backing_file(const std::filesystem::path& image, const std::string& name)
+{
+    std::filesystem::path backing = name;
+    return backing.is_relative()? image.parent_path() / backing : backing;
+}
+
+std::optional<std::filesystem::path> qcow2_reader::backing_file(const std::filesystem::path& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("Cannot open " + path.string() + ": " + strerror(errno));
+    //else
+    qcow2_header_t header = {};
+    std::string name;
+    if (::pread(fd, &header, qcow2_v2_header_size, 0) == (ssize_t)qcow2_v2_header_size && is_qcow2(header.magic)) {
+        auto backing_file_size = be32toh(header.backing_file_size);
+        if (header.backing_file_offset != 0 && backing_file_size > 0 && backing_file_size <= 1023) {
+            name.resize(backing_file_size);
+            auto r = ::pread(fd, name.data(), backing_file_size, be64toh(header.backing_file_offset));
+            if (r != (ssize_t)backing_file_size) name.clear();
+        }
+    }
+    ::close(fd);
+    if (name.empty()) return std::nullopt;
+    //else
+    return resolve_backing_file(path, name);
+}
+
+qcow2_reader::qcow2_reader(const std::filesystem::path& path, int depth) : path_(path)
+{
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("Cannot open " + path.string() + ": " + strerror(errno));
+    //else
+    try {
+        qcow2_header_t header = {};
+        read_file(&header, qcow2_v2_header_size, 0);
+        if (!is_qcow2(header.magic)) throw std::runtime_error(path.string() + " is not a qcow2 image");
+        //else
+        auto version = be32toh(header.version);
+        if (version != 2 && version != 3) throw std::runtime_error(path.string() + ": unsupported qcow2 version " + std::to_string(version));
+        //else
+        if (version == 3) {
+            read_file((uint8_t*)&header + qcow2_v2_header_size, qcow2_v3_header_size - qcow2_v2_header_size, qcow2_v2_header_size);
+            if (be32toh(header.header_length) > qcow2_v3_header_size) read_file(&header.compression_type, 1, qcow2_v3_header_size);
+            auto incompatible = be64toh(header.incompatible_features);
+            if (incompatible & ~incompat_understood) {
+                throw std::runtime_error(path.string() + ": unsupported qcow2 features(external data file or extended L2 entries?)");
+            }
+            //else
+            if ((incompatible & incompat_compression_type) && header.compression_type != 0/*zlib*/) {
+                throw std::runtime_error(path.string() + ": unsupported qcow2 compression(zstd?)");
+            }
+            //else
+            if (incompatible & incompat_corrupt) trace(path.string(), ": qcow2 image marked corrupt, reading it anyway");
+        }
+        if (be32toh(header.crypt_method) != 0) throw std::runtime_error(path.string() + ": encrypted qcow2 images are not supported");
+        //else
+        cluster_bits = be32toh(header.cluster_bits);
+        if (cluster_bits < 9 || cluster_bits > 21) throw std::runtime_error(path.string() + ": bad qcow2 cluster size");
+        //else
+        cluster_size = 1ULL << cluster_bits;
+        size_ = be64toh(header.size);
+
+        // one L1 entry per cluster_size / 8 clusters
+        auto l1_size = be32toh(header.l1_size);
+        uint64_t l2_span = cluster_size / sizeof(uint64_t) * cluster_size;
+        if (l1_size > max_l1_size || (uint64_t)l1_size * l2_span < size_) throw std::runtime_error(path.string() + ": bad qcow2 L1 table size");
+        //else
+        l1_.resize(l1_size);
+        read_file(l1_.data(), l1_size * sizeof(uint64_t), be64toh(header.l1_table_offset));
+        for (auto& entry : l1_) entry = be64toh(entry);
+
+        auto backing_file_size = be32toh(header.backing_file_size);
+        if (header.backing_file_offset != 0 && backing_file_size > 0) {
+            if (depth + 1 > max_backing_depth) throw std::runtime_error(path.string() + ": qcow2 backing chain too long(loop?)");
+            //else
+            if (backing_file_size > 1023) throw std::runtime_error(path.string() + ": bad qcow2 backing file name");
+            //else
+            std::string name(backing_file_size, '\0');
+            read_file(name.data(), backing_file_size, be64toh(header.backing_file_offset));
+            auto backing = resolve_backing_file(path, name);
+            trace(path.string(), ": backed by ", backing.string());
+            backing_ = open_image(backing, depth + 1);
+        }
+        sector_size_ = probe_image_sector_size(*this);
+    }
+    catch (...) {
+        ::close(fd);
+        throw;
+    }
+}
+
+qcow2_reader::~qcow2_reader()
+{
+    ::close(fd);
+}
+
+void qcow2_reader::read_file(void* buf, size_t size, uint64_t offset) const
+{
+    auto r = ::pread(fd, buf, size, offset);
+    if (r < (ssize_t)size) throw std::runtime_error("Short read from " + path_.string());
+}
+
+// the L2 entry mapping guest_cluster(host byte order), 0 when its L2 table isn't allocated
+uint64_t qcow2_reader::l2_entry(uint64_t guest_cluster)
+{
+    auto entries_per_table = cluster_size / sizeof(uint64_t);
+    auto l1_index = guest_cluster / entries_per_table;
+    if (l1_index >= l1_.size()) return 0;
+    //else
+    auto l2_offset = l1_[l1_index] & l1_offset_mask;
+    if (l2_offset == 0) return 0;
+    //else
+    auto table = std::find_if(l2_cache_.begin(), l2_cache_.end(), [l2_offset](const l2_table& t) { return t.offset == l2_offset; });
+    if (table == l2_cache_.end()) {
+        if (l2_cache_.size() < l2_cache_tables) {
+            table = l2_cache_.insert(l2_cache_.end(), l2_table { l2_offset, {}, 0 });
+        } else {
+            // least recently used
+            table = std::min_element(l2_cache_.begin(), l2_cache_.end(),
+                [](const l2_table& a, const l2_table& b) { return a.last_used < b.last_used; });
+            table->offset = l2_offset;
+        }
+        table->entries.resize(entries_per_table);
+        try {
+            read_file(table->entries.data(), cluster_size, l2_offset);
+        }
+        catch (...) {
+            l2_cache_.erase(table);
+            throw;
+        }
+        for (auto& entry : table->entries) entry = be64toh(entry);
+    }
+    table->last_used = ++l2_clock_;
+    return table->entries[guest_cluster % entries_per_table];
+}
+
+// size bytes at guest_offset, all within one cluster
+void qcow2_reader::read_cluster(uint8_t* buf, size_t size, uint64_t guest_offset)
+{
+    auto in_cluster = guest_offset & (cluster_size - 1);
+    auto entry = l2_entry(guest_offset >> cluster_bits);
+
+    if (entry & l2_compressed) {
+        // offset of the compressed data, then the number of additional 512 byte sectors it spans
+        auto offset_bits = 62 - (cluster_bits - 8);
+        auto host_offset = entry & ((1ULL << offset_bits) - 1);
+        auto sectors = (entry & ~(3ULL << 62)) >> offset_bits;
+        if (entry != compressed_cluster_) {
+            size_t compressed_size = (sectors + 1) * 512 - (host_offset & 511);
+            std::vector<uint8_t> compressed(compressed_size);
+            // the last sectors may lie beyond the end of the file
+            auto r = ::pread(fd, compressed.data(), compressed_size, host_offset);
+            if (r <= 0) throw std::runtime_error("Short read from " + path_.string());
+            //else
+            inflated_.resize(cluster_size);
+            z_stream z = {};
+            if (inflateInit2(&z, -12/*raw deflate, 4KiB window*/) != Z_OK) throw std::runtime_error("inflateInit2() failed");
+            //else
+            z.next_in = compressed.data();
+            z.avail_in = r;
+            z.next_out = inflated_.data();
+            z.avail_out = cluster_size;
+            auto rst = inflate(&z, Z_FINISH);
+            inflateEnd(&z);
+            if ((rst != Z_STREAM_END && rst != Z_BUF_ERROR) || z.avail_out != 0) {
+                compressed_cluster_ = UINT64_MAX;
+                throw std::runtime_error(path_.string() + ": corrupt compressed cluster");
+            }
+            //else
+            compressed_cluster_ = entry;
+        }
+        memcpy(buf, inflated_.data() + in_cluster, size);
+        return;
+    }
+    //else
+    auto host_offset = entry & l2_offset_mask;
+    if (entry & l2_zero) {
+        memset(buf, 0, size);
+    } else if (host_offset != 0) {
+        read_file(buf, size, host_offset + in_cluster);
+    } else if (backing_ && guest_offset < backing_->size()) {
+        // a backing file smaller than this image reads as zeros past its end
+        auto from_backing = std::min<uint64_t>(size, backing_->size() - guest_offset);
+        backing_->pread(buf, from_backing, guest_offset);
+        memset(buf + from_backing, 0, size - from_backing);
+    } else {
+        memset(buf, 0, size);
+    }
+}
+
+void qcow2_reader::pread(void* buf, size_t size, uint64_t offset)
+{
+    if (offset > size_ || size > size_ - offset) throw std::runtime_error("Read beyond end of image");
+    //else
+    auto p = (uint8_t*)buf;
+    while (size > 0) {
+        auto chunk = std::min<uint64_t>(size, cluster_size - (offset & (cluster_size - 1)));
+        read_cluster(p, chunk, offset);
+        p += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+}
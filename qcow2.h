@@ -0,0 +1,63 @@
+/*
+ * detect_efi_boot_partition
+ *  Read-only qcow2 image reader
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __QCOW2_H__
+#define __QCOW2_H__
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+#include <optional>
+#include <filesystem>
+
+#include "partition_table.h"
+
+// The guest-visible contents of a qcow2(version 2 or 3) image. Only the metadata on the way to the clusters
+// asked for is read: the L1 table when opened, then L2 tables on demand, of which the last few are cached.
+// Unallocated clusters come from the backing file(raw or qcow2 itself, opened with open_image()) or read as
+// zeros; zlib compressed clusters are inflated. Encrypted images, external data files, extended L2 entries
+// and zstd compression are refused.
+class qcow2_reader : public block_reader {
+    struct l2_table {
+        uint64_t offset;
+        std::vector<uint64_t> entries;  // host byte order
+        uint64_t last_used;
+    };
+    std::filesystem::path path_;
+    int fd = -1;
+    uint32_t cluster_bits;
+    uint64_t cluster_size;
+    uint64_t size_ = 0;
+    unsigned int sector_size_ = 512;
+    std::vector<uint64_t> l1_;  // host byte order
+    std::vector<l2_table> l2_cache_;
+    uint64_t l2_clock_ = 0;
+    std::unique_ptr<block_reader> backing_;
+    uint64_t compressed_cluster_ = UINT64_MAX;  // L2 entry of the cluster in inflated_
+    std::vector<uint8_t> inflated_;
+
+    void read_file(void* buf, size_t size, uint64_t offset) const;
+    uint64_t l2_entry(uint64_t guest_cluster);
+    void read_cluster(uint8_t* buf, size_t size, uint64_t guest_offset);
+public:
+    static constexpr int max_backing_depth = 16;
+    // depth: how many images down the backing chain this one is
+    explicit qcow2_reader(const std::filesystem::path& path, int depth = 0);  // throws when not a usable qcow2 image
+    ~qcow2_reader() override;
+    qcow2_reader(const qcow2_reader&) = delete;
+    qcow2_reader& operator=(const qcow2_reader&) = delete;
+
+    void pread(void* buf, size_t size, uint64_t offset) override;
+    uint64_t size() const override { return size_; }
+    unsigned int sector_size() const override { return sector_size_; }
+
+    static bool is_qcow2(const uint8_t* magic);     // magic: the first 4 bytes of a file
+    // the backing file named by the header of path, if path is a qcow2 image having one; reads the header only
+    static std::optional<std::filesystem::path> backing_file(const std::filesystem::path& path);
+};
+
+#endif // __QCOW2_H__
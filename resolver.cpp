@@ -0,0 +1,335 @@
+/*
+ * detect_efi_boot_partition
+ *  Partition lookup backends
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <strings.h>
+#include <sys/stat.h>
+
+#include <mutex>
+#include <atomic>
+#include <future>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <algorithm>
+#include <exception>
+#include <condition_variable>
+
+#include "resolver.h"
+#include "host_record.h"
+#include "metrics.h"
+
+static std::shared_future<std::vector<block_device>> prefetched_devices;
+
+void prefetch_block_devices()
+{
+    prefetched_devices = std::async(std::launch::async, []() { return enumerate_block_devices(); }).share();
+}
+
+std::vector<block_device> block_devices()
+{
+    if (!prefetched_devices.valid()) return enumerate_block_devices();
+    //else
+    auto start = std::chrono::steady_clock::now();
+    auto devices = prefetched_devices.get();
+    std::chrono::duration<double> waited = std::chrono::steady_clock::now() - start;
+    trace("joined prefetched device enumeration(", devices.size(), " devices) after waiting ", waited.count(), "s");
+    return devices;
+}
+
+const std::vector<block_device>& lookup_context::devices()
+{
+    if (!devices_) devices_ = block_devices();
+    return *devices_;
+}
+
+std::vector<const block_device*> select_disks(const std::vector<block_device>& devices, const resolver_options& options)
+{
+    std::vector<const block_device*> disks;
+    size_t total = 0;
+    for (const auto& dev : devices) {
+        if (dev.is_partition() || dev.size == 0) continue; // partition entries live in whole disks; skip empty drives
+        //else
+        total++;
+        if (options.filter.accepts(dev)) disks.push_back(&dev);
+        else trace("excluded ", dev.name, " (", to_string(dev.cls), dev.removable? ", removable" : "", ")");
+    }
+    metrics.devices_excluded = total - disks.size();
+    trace("device filter: ", total, " disks before, ", disks.size(), " after");
+    auto representatives = collapse_stacked(devices, disks, options.filter);
+    trace("stacked devices: ", disks.size(), " disks before, ", representatives.size(), " representatives after");
+    return representatives;
+}
+
+// the previous answer, as long as the device node still is what it was, the kernel still sees the
+// partition where the firmware says it is and udev still knows it by the PARTUUID. No block device I/O.
+std::optional<std::filesystem::path> lookup_answer_cache(lookup_context& ctx)
+{
+    if (!ctx.record.answer) return {};
+    //else
+    const auto& answer = *ctx.record.answer;
+    if (strcasecmp(answer.partuuid.c_str(), ctx.query.partuuid.c_str()) != 0) return {};
+    //else
+    struct stat st;
+    if (stat(answer.device.c_str(), &st) < 0 || !S_ISBLK(st.st_mode) || st.st_rdev != answer.devnum) return {};
+    //else
+    auto dev = find_device(ctx.devices(), answer.devnum);
+    if (!dev) return {};
+    //else
+    if (dev->is_partition() && ctx.query.partno > 0) {
+        auto lbs = dev->logical_block_size;
+        if (dev->partno != (int)ctx.query.partno || dev->start * 512 != ctx.query.start_lba * lbs
+            || dev->size * 512 != ctx.query.size_lba * lbs) return {};
+    }
+    //else
+    // same node and geometry may still be another partition(a disk swapped for a clone, a reformatted one)
+    if (!metadata_confirms_partuuid(ctx, *dev)) return {};
+    //else
+    return answer.device;
+}
+
+static std::vector<backend_def>& backend_registry()
+{
+    static std::vector<backend_def> backends = {
+        // name             touches_devices in_auto_chain prior_cost resolve
+        { "answer-cache",   false,  true,   0.0001, lookup_answer_cache },
+        { "by-partuuid",    false,  true,   0.0002, lookup_by_partuuid_symlink },
+        { "udev-db",        false,  true,   0.002,  lookup_udev_db },
+        { "sysfs-geometry", true,   true,   0.005,  scan_geometry_candidates },
+        { "native",         true,   true,   0.02,   scan_partition_tables },
+        { "blkid-probe",    true,   true,   0.05,   probe_partition_tables },
+        { "blkid-cache",    true,   false,  0.5,    search_blkid_cache },
+    };
+    return backends;
+}
+
+const std::vector<backend_def>& all_backends()
+{
+    return backend_registry();
+}
+
+void register_backend(const backend_def& backend)
+{
+    backend_registry().push_back(backend);
+}
+
+const backend_def* find_backend(const std::string& name)
+{
+    for (const auto& backend : all_backends()) {
+        if (name == backend.name) return &backend;
+    }
+    //else
+    return nullptr;
+}
+
+// Trying backends in ascending cost/P(success) minimizes the expected total cost.
+// P(success) is Laplace smoothed so that a single miss doesn't bury a backend forever.
+static double expected_cost(const backend_def& backend, const host_record& record)
+{
+    auto it = record.backends.find(backend.name);
+    if (it == record.backends.end()) return backend.prior_cost * 2;
+    //else
+    const auto& stats = it->second;
+    double cost = stats.mean_seconds > 0.0? stats.mean_seconds : backend.prior_cost;
+    double p = (stats.successes + 1.0) / (stats.successes + stats.failures + 2.0);
+    return cost / p;
+}
+
+static std::vector<const backend_def*> build_chain(const std::vector<std::string>& names, const host_record& record)
+{
+    std::vector<const backend_def*> chain;
+    if (!names.empty()) {
+        for (const auto& name : names) {
+            auto backend = find_backend(name);
+            if (!backend) throw std::runtime_error("Unknown backend: " + name);
+            chain.push_back(backend);
+        }
+        return chain;
+    }
+    //else
+    for (const auto& backend : all_backends()) {
+        if (backend.in_auto_chain) chain.push_back(&backend);
+    }
+    std::stable_sort(chain.begin(), chain.end(), [&record](const backend_def* a, const backend_def* b) {
+        return expected_cost(*a, record) < expected_cost(*b, record);
+    });
+    return chain;
+}
+
+const std::vector<std::string> default_race_backends = { "by-partuuid", "udev-db", "sysfs-geometry", "native" };
+
+struct attempt {
+    const backend_def* backend;
+    std::optional<std::filesystem::path> found;
+    double seconds;
+    std::exception_ptr error;
+};
+
+static attempt run_backend(const backend_def* backend, lookup_context& ctx)
+{
+    attempt result { backend, std::nullopt, 0.0, nullptr };
+    auto start = std::chrono::steady_clock::now();
+    try {
+        result.found = backend->resolve(ctx);
+    }
+    catch (const std::runtime_error& e) {
+        trace("backend ", backend->name, " failed: ", e.what());
+        result.error = std::current_exception();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    result.seconds = elapsed.count();
+    trace("backend ", backend->name, result.found? " answered " : " gave no answer ", "in ", result.seconds, "s");
+    return result;
+}
+
+static void account(const attempt& a, host_record& record)
+{
+    metrics.backend_seconds.emplace_back(a.backend->name, a.seconds);
+    record.record(a.backend->name, a.found.has_value(), a.seconds);
+}
+
+static std::optional<attempt> run_chain(const std::vector<const backend_def*>& chain, lookup_context& ctx,
+    host_record& record, std::exception_ptr& error)
+{
+    for (const auto* backend : chain) {
+        auto a = run_backend(backend, ctx);
+        account(a, record);
+        if (a.found) return a;
+        //else
+        if (a.error) error = a.error;
+    }
+    //else
+    return {};
+}
+
+// Everything a racing backend touches, owned jointly by the racers: the losers are left behind
+// (detached) rather than waited for, since one of them may sit in a read from a sleeping disk.
+// What they touch beyond that(metrics, read_budget, trace_mutex, the backend list) are statics,
+// so the process has to end by _exit() while any of them is running; racers_running() tells.
+struct race_state {
+    const partition_query query;
+    const resolver_options options;
+    const host_record record;
+    lookup_context ctx;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<attempt> finished;
+
+    race_state(const partition_query& _query, const resolver_options& _options, const host_record& _record)
+        : query(_query), options(_options), record(_record), ctx(query, options, record) {}
+};
+
+static std::atomic<unsigned int> running_racers = 0;
+
+bool racers_running()
+{
+    return running_racers > 0;
+}
+
+static std::optional<attempt> race(const std::vector<const backend_def*>& chain, const partition_query& query,
+    const resolver_options& options, host_record& record, std::exception_ptr& error)
+{
+    auto state = std::make_shared<race_state>(query, options, record);
+    state->ctx.devices(); // enumerate before anyone needs it; lookup_context isn't thread safe otherwise
+
+    std::vector<std::thread> racers;
+    for (const auto* backend : chain) {
+        running_racers++;
+        racers.emplace_back([state, backend]() {
+            set_io_priority(state->options.ioprio);
+            auto a = run_backend(backend, state->ctx);
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->finished.push_back(std::move(a));
+                state->cv.notify_all();
+            }
+            running_racers--;
+        });
+    }
+
+    std::optional<attempt> winner;
+    {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        size_t seen = 0;
+        while (seen < racers.size()) {
+            state->cv.wait(lock, [&]() { return state->finished.size() > seen; });
+            for (; seen < state->finished.size(); seen++) {
+                const auto& a = state->finished[seen];
+                account(a, record);
+                if (a.found && !winner) winner = a;
+                if (a.error) error = a.error;
+            }
+            if (winner && !options.cross_check) break;
+        }
+        state->ctx.cancelled = true;
+    }
+
+    if (winner && !options.cross_check) {
+        for (auto& racer : racers) racer.detach();
+        return winner;
+    }
+    //else
+    for (auto& racer : racers) racer.join();
+    if (winner) {
+        for (const auto& a : state->finished) {
+            if (!a.found || *a.found == *winner->found) continue;
+            //else
+            trace("backend ", a.backend->name, " disagrees: ", a.found->string(), " != ", winner->found->string());
+            metrics.disagreements.push_back(std::string(a.backend->name) + "=" + a.found->string());
+        }
+    }
+    return winner;
+}
+
+std::optional<std::filesystem::path> resolve_partition(const partition_query& query, const resolver_options& options)
+{
+    set_io_priority(options.ioprio);
+    auto record = options.state_file? host_record::load(*options.state_file) : host_record();
+
+    auto chain = build_chain(options.race && options.backends.empty()? default_race_backends : options.backends, record);
+    std::string skipped;    // for --no-device-io
+    chain.erase(std::remove_if(chain.begin(), chain.end(), [&options, &skipped](const backend_def* backend) {
+        if (options.no_device_io && backend->touches_devices) {
+            trace("skipping backend ", backend->name, " (--no-device-io)");
+            skipped += (skipped.empty()? "" : ",") + std::string(backend->name);
+            return true;
+        }
+        return false;
+    }), chain.end());
+
+    std::exception_ptr error;
+    std::optional<attempt> winner;
+    if (options.race) {
+        winner = race(chain, query, options, record, error);
+    } else {
+        lookup_context ctx(query, options, record);
+        winner = run_chain(chain, ctx, record, error);
+    }
+
+    if (winner) {
+        metrics.backend = winner->backend->name;
+        if (winner->backend->resolve == lookup_answer_cache) metrics.cache_hit = true;
+        struct stat st;
+        if (stat(winner->found->c_str(), &st) == 0) record.answer = cached_answer { query.partuuid, st.st_rdev, *winner->found };
+    }
+    if (options.state_file) {
+        try {
+            record.save(*options.state_file);
+        }
+        catch (const std::runtime_error& e) {
+            trace("host record not saved: ", e.what());
+        }
+    }
+
+    if (!winner && !skipped.empty()) {
+        throw detection_error(failure_reason::device_io_forbidden,
+            "Partition not found without opening block devices(skipped " + skipped + " for --no-device-io)");
+    }
+    //else
+    if (!winner && error) std::rethrow_exception(error);
+    //else
+    return winner? winner->found : std::nullopt;
+}
@@ -0,0 +1,112 @@
+/*
+ * detect_efi_boot_partition
+ *  Partition lookup backends
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <optional>
+#include <filesystem>
+
+#include "sysfs.h"
+#include "io_throttle.h"
+#include "partition_table.h"
+
+struct resolver_options {
+    // backend names to try in this order; empty means every auto backend, ordered by the learned cost model
+    std::vector<std::string> backends;
+    std::optional<std::filesystem::path> state_file;    // per-host answer cache and backend statistics
+    std::optional<std::filesystem::path> blkid_cache_file;  // persistent cache for the 'blkid-cache' backend
+    bool direct_io = false; // native backends read with O_DIRECT
+    bool no_device_io = false;  // skip every backend which opens block devices
+    device_filter filter;   // backends enumerating disks themselves; blkid_probe_all() can't be told
+    io_priority ioprio = io_priority::none; // of every thread probing devices
+    bool race = false;  // run the backends concurrently, first answer wins
+    bool cross_check = false;   // with race: let every backend finish and report disagreements
+};
+
+// what the firmware's MEDIA_HARDDRIVE_DP node says about the partition
+struct partition_query {
+    partition_id id;        // matched binary by the native backends
+    std::string partuuid;   // id as text, for backends looking it up by name
+    uint32_t partno = 0;    // 0 when unknown
+    uint64_t start_lba = 0; // in logical blocks of the disk
+    uint64_t size_lba = 0;
+};
+
+struct host_record;
+
+// state shared by the backends of one lookup
+class lookup_context {
+    std::optional<std::vector<block_device>> devices_;
+public:
+    const partition_query query;
+    const resolver_options& options;
+    const host_record& record;  // what previous runs on this host learned
+    std::atomic<bool> cancelled = false;    // another backend already answered(--race); bail out early
+    lookup_context(const partition_query& _query, const resolver_options& _options, const host_record& _record)
+        : query(_query), options(_options), record(_record) {}
+    const std::vector<block_device>& devices();  // enumerated once, on first use
+};
+
+typedef std::optional<std::filesystem::path> (*backend_func)(lookup_context& ctx);
+
+struct backend_def {
+    const char* name;
+    bool touches_devices;   // opens block devices(never run with --no-device-io)
+    bool in_auto_chain;
+    double prior_cost;      // seconds; assumed until measured on this host
+    backend_func resolve;
+};
+
+const std::vector<backend_def>& all_backends();
+const backend_def* find_backend(const std::string& name);
+// adds a backend by the name it is given(tests); only before the first lookup
+void register_backend(const backend_def& backend);
+
+// starts enumerating block devices(sysfs only) on another thread, so that it overlaps with reading
+// efivars; the next lookup_context picks the result up instead of enumerating by itself
+void prefetch_block_devices();
+// the prefetched enumeration if there is one, enumerated now otherwise
+std::vector<block_device> block_devices();
+
+// whole disks worth opening: non-empty and accepted by options.filter, one per stacked set
+std::vector<const block_device*> select_disks(const std::vector<block_device>& devices, const resolver_options& options);
+
+// libblkid high-level cache API: blkid_probe_all() + blkid_verify()
+// With cache_file, cached entries are revalidated by blkid_verify() first, escalating to
+// blkid_probe_all_new() and then blkid_probe_all() only when they are stale or missing.
+std::optional<std::filesystem::path>
+    search_partition(const std::string& key, const std::string& value,
+        const std::optional<std::filesystem::path>& cache_file = std::nullopt);
+
+// whether the udev database or /dev/disk/by-partuuid says dev is(or was lifted from) the partition queried
+bool metadata_confirms_partuuid(lookup_context& ctx, const block_device& dev);
+
+// backends
+std::optional<std::filesystem::path> lookup_answer_cache(lookup_context& ctx);
+std::optional<std::filesystem::path> lookup_by_partuuid_symlink(lookup_context& ctx);
+std::optional<std::filesystem::path> lookup_udev_db(lookup_context& ctx);
+std::optional<std::filesystem::path> scan_geometry_candidates(lookup_context& ctx);
+std::optional<std::filesystem::path> scan_partition_tables(lookup_context& ctx);
+std::optional<std::filesystem::path> probe_partition_tables(lookup_context& ctx);
+std::optional<std::filesystem::path> search_blkid_cache(lookup_context& ctx);
+
+// backends raced by default: cheap metadata lookups against the native scan
+extern const std::vector<std::string> default_race_backends;
+
+// runs the backend chain until one answers, or races it with options.race
+std::optional<std::filesystem::path> resolve_partition(const partition_query& query, const resolver_options& options);
+
+// losing racers(--race) left behind are still running; exit by _exit() then, since static destructors
+// would pull what they use from under them
+bool racers_running();
+
+#endif // __RESOLVER_H__
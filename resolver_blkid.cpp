@@ -0,0 +1,132 @@
+/*
+ * detect_efi_boot_partition
+ *  libblkid based partition lookup backends
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <strings.h>
+
+#include <memory>
+
+#include <blkid/blkid.h>
+
+#include "resolver.h"
+#include "sysfs.h"
+#include "metrics.h"
+#include "device_reader.h"
+
+// verifies every cached device carrying key=value, returns the first one still carrying it;
+// verified: incremented per device blkid_verify() was run on
+static std::optional<std::filesystem::path>
+    find_verified(blkid_cache cache, const std::string& key, const std::string& value, uint64_t& verified)
+{
+    std::shared_ptr<blkid_struct_dev_iterate> dev_iter(blkid_dev_iterate_begin(cache),blkid_dev_iterate_end);
+    if (!dev_iter)  throw detection_error(failure_reason::probe_error, "blkid_dev_iterate_begin() failed");
+
+    if (blkid_dev_set_search(dev_iter.get(), key.c_str(), value.c_str()) < 0) 
+        throw detection_error(failure_reason::probe_error, "blkid_dev_set_search() failed");
+    blkid_dev dev = NULL;
+    while (blkid_dev_next(dev_iter.get(), &dev) == 0) {
+        verified++;
+        dev = blkid_verify(cache, dev);
+        if (dev) return blkid_dev_devname(dev);
+    }
+    //else
+    return {}; // not found
+}
+
+static uint64_t count_cached_devices(blkid_cache cache)
+{
+    uint64_t count = 0;
+    std::shared_ptr<blkid_struct_dev_iterate> dev_iter(blkid_dev_iterate_begin(cache),blkid_dev_iterate_end);
+    blkid_dev dev = NULL;
+    while (dev_iter && blkid_dev_next(dev_iter.get(), &dev) == 0) count++;
+    return count;
+}
+
+std::optional<std::filesystem::path>
+    search_partition(const std::string& key, const std::string& value,
+        const std::optional<std::filesystem::path>& cache_file/* = std::nullopt*/)
+{
+    check_device_open("(every block device)");  // blkid_probe_all() can't be inspected: count as one
+    if (cache_file) {
+        std::error_code ec;
+        std::filesystem::create_directories(cache_file->parent_path(), ec); // blkid won't save otherwise
+    }
+    blkid_cache _cache;
+    // "/dev/null" disables the on-disk cache: every run is a full probe
+    if (blkid_get_cache(&_cache, cache_file? cache_file->c_str() : "/dev/null") < 0)
+        throw detection_error(failure_reason::probe_error, "blkid_get_cache() failed");
+    auto cache = std::shared_ptr<blkid_struct_cache>(_cache, blkid_put_cache);   // blkid_put_cache() saves the file
+
+    if (cache_file) {
+        // tier 1: revalidate only the device(s) the cache file says carry the value
+        auto cached = count_cached_devices(cache.get());
+        uint64_t verified = 0;
+        if (auto found = find_verified(cache.get(), key, value, verified)) {
+            metrics.devices_scanned = verified;
+            metrics.cache_hit = true;
+            metrics.cache_tier = "verify";
+            return found;
+        }
+        // tier 2: probe only devices which are not in the cache yet
+        if (blkid_probe_all_new(cache.get()) < 0) throw detection_error(failure_reason::probe_error, "blkid_probe_all_new() failed");
+        if (auto found = find_verified(cache.get(), key, value, verified)) {
+            metrics.devices_scanned = count_cached_devices(cache.get()) - cached;
+            metrics.cache_tier = "probe_all_new";
+            return found;
+        }
+    }
+
+    // tier 3: full probe
+    if (blkid_probe_all(cache.get()) < 0) throw detection_error(failure_reason::probe_error, "blkid_probe_all() failed");
+    metrics.devices_scanned = count_cached_devices(cache.get());
+    metrics.cache_tier = "probe_all";
+    uint64_t verified = 0;
+    return find_verified(cache.get(), key, value, verified);
+}
+
+std::optional<std::filesystem::path> search_blkid_cache(lookup_context& ctx)
+{
+    return search_partition("PARTUUID", ctx.query.partuuid, ctx.options.blkid_cache_file);
+}
+
+std::optional<std::filesystem::path> probe_partition_tables(lookup_context& ctx)
+{
+    const auto& partuuid = ctx.query.partuuid;
+    const auto& devices = ctx.devices();
+    for (const auto* disk : select_disks(devices, ctx.options)) {
+        if (ctx.cancelled) break;
+        //else
+        check_device_open(disk->devpath());
+        std::shared_ptr<blkid_struct_probe> pr(blkid_new_probe_from_filename(disk->devpath().c_str()), blkid_free_probe);
+        if (!pr) continue; // vanished, or no permission
+        //else
+        metrics.devices_scanned++;
+        // partition table only: no filesystem/RAID/crypto superblock probing
+        if (blkid_probe_enable_superblocks(pr.get(), 0) < 0
+            || blkid_probe_enable_partitions(pr.get(), 1) < 0
+            || blkid_probe_set_partitions_flags(pr.get(), BLKID_PARTS_ENTRY_DETAILS) < 0) {
+            throw detection_error(failure_reason::probe_error, "Configuring blkid probe failed");
+        }
+        if (blkid_do_safeprobe(pr.get()) < 0) continue;
+        //else
+        auto partlist = blkid_probe_get_partitions(pr.get());
+        if (!partlist) continue; // no partition table
+        //else
+        int nparts = blkid_partlist_numof_partitions(partlist);
+        for (int i = 0; i < nparts; i++) {
+            auto par = blkid_partlist_get_partition(partlist, i);
+            auto uuid = blkid_partition_get_uuid(par);
+            if (!uuid || strcasecmp(uuid, partuuid.c_str()) != 0) continue;
+            //else
+            if (auto dev = find_partition(devices, disk->name, blkid_partition_get_partno(par))) return lift_stacked(devices, dev)->devpath();
+            //else
+            throw detection_error(failure_reason::partition_not_found,
+                "PARTUUID=" + partuuid + " found on " + disk->devpath().string() + " but kernel has no partition device for it");
+        }
+    }
+    //else
+    return {}; // not found
+}
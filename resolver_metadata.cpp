@@ -0,0 +1,66 @@
+/*
+ * detect_efi_boot_partition
+ *  Partition lookup from metadata only(/dev symlinks, udev database); never opens block devices
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <fstream>
+
+#include "resolver.h"
+
+// /dev/disk/by-partuuid/<partuuid>, maintained by udev rules
+std::optional<std::filesystem::path> lookup_by_partuuid_symlink(lookup_context& ctx)
+{
+    std::error_code ec;
+    auto link = std::filesystem::path("/dev/disk/by-partuuid") / ctx.query.partuuid;
+    auto target = std::filesystem::canonical(link, ec);
+    if (ec) return {};
+    //else
+    struct stat st;
+    if (stat(target.c_str(), &st) < 0 || !S_ISBLK(st.st_mode)) return {};
+    //else
+    auto dev = find_device(ctx.devices(), st.st_rdev);
+    return dev? lift_stacked(ctx.devices(), dev)->devpath() : target;
+}
+
+// E:ID_PART_ENTRY_UUID= of /run/udev/data/b<major>:<minor>
+static std::optional<std::string> udev_partuuid(dev_t devnum)
+{
+    std::ifstream db("/run/udev/data/b" + std::to_string(major(devnum)) + ":" + std::to_string(minor(devnum)));
+    static const std::string key = "E:ID_PART_ENTRY_UUID=";
+    std::string line;
+    while (std::getline(db, line)) {
+        if (line.compare(0, key.size(), key) == 0) return line.substr(key.size());
+    }
+    //else
+    return {};
+}
+
+bool metadata_confirms_partuuid(lookup_context& ctx, const block_device& dev)
+{
+    auto uuid = udev_partuuid(dev.devnum);
+    if (uuid && strcasecmp(uuid->c_str(), ctx.query.partuuid.c_str()) == 0) return true;
+    //else
+    // a lifted device(md array, multipath map partition) carries no PARTUUID of its own; its member's link leads to it
+    auto found = lookup_by_partuuid_symlink(ctx);
+    return found && *found == dev.devpath();
+}
+
+std::optional<std::filesystem::path> lookup_udev_db(lookup_context& ctx)
+{
+    const auto& devices = ctx.devices();
+    for (const auto& dev : devices) {
+        if (ctx.cancelled) break;
+        if (!dev.is_partition()) continue;
+        //else
+        auto uuid = udev_partuuid(dev.devnum);
+        if (uuid && strcasecmp(uuid->c_str(), ctx.query.partuuid.c_str()) == 0) return lift_stacked(devices, &dev)->devpath();
+    }
+    //else
+    return {};
+}
@@ -0,0 +1,87 @@
+/*
+ * detect_efi_boot_partition
+ *  Native partition table scanning backends
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <strings.h>
+
+#include <algorithm>
+
+#include "resolver.h"
+#include "sysfs.h"
+#include "device_reader.h"
+#include "metrics.h"
+
+static std::optional<std::filesystem::path>
+    scan_disks(lookup_context& ctx, const std::vector<const block_device*>& disks)
+{
+    const auto& id = ctx.query.id;
+    const auto& devices = ctx.devices();
+    uint64_t page_cache_bytes = 0;
+    auto account = [&page_cache_bytes]() { metrics.page_cache_bytes += page_cache_bytes; metrics.page_cache_measured = true; };
+    for (const auto* disk : disks) {
+        if (ctx.cancelled) break;
+        //else
+        std::optional<partition_table> table;
+        try {
+            device_reader reader(disk->devpath(), ctx.options.direct_io);
+            metrics.devices_scanned++;
+            table = read_partition_table(reader);
+            page_cache_bytes += reader.page_cache_bytes();
+        }
+        catch (const detection_error&) {
+            throw;
+        }
+        catch (const std::runtime_error&) {
+            continue;   // unreadable device(no medium, permission...) cannot be the one we booted from
+        }
+        if (!table) continue;
+        //else
+        for (const auto& part : table->partitions) {
+            if (part.id != id) continue;
+            //else
+            account();
+            if (auto dev = find_partition(devices, disk->name, part.partno)) return lift_stacked(devices, dev)->devpath();
+            //else
+            throw detection_error(failure_reason::partition_not_found,
+                "PARTUUID=" + ctx.query.partuuid + " found on " + disk->devpath().string() + " but kernel has no partition device for it");
+        }
+    }
+    account();
+    return {}; // not found
+}
+
+std::optional<std::filesystem::path> scan_partition_tables(lookup_context& ctx)
+{
+    return scan_disks(ctx, select_disks(ctx.devices(), ctx.options));
+}
+
+// reads only disks carrying a partition with the number, start and size the firmware recorded
+std::optional<std::filesystem::path> scan_geometry_candidates(lookup_context& ctx)
+{
+    const auto& query = ctx.query;
+    if (query.partno == 0 || query.size_lba == 0) return {};
+    //else
+    const auto& devices = ctx.devices();
+    std::vector<std::string> candidates;
+    for (const auto& dev : devices) {
+        if (!dev.is_partition() || dev.partno != (int)query.partno) continue;
+        //else
+        auto lbs = dev.logical_block_size;
+        if (dev.start * 512 == query.start_lba * lbs && dev.size * 512 == query.size_lba * lbs) candidates.push_back(dev.disk);
+    }
+    trace("sysfs geometry: ", candidates.size(), " candidate disk(s)");
+    if (candidates.empty()) return {};
+    //else
+    auto disks = select_disks(devices, ctx.options);
+    disks.erase(std::remove_if(disks.begin(), disks.end(), [&](const block_device* disk) {
+        // a multipath map stands for its paths
+        for (const auto& name : candidates) {
+            if (disk->name == name || std::find(disk->slaves.begin(), disk->slaves.end(), name) != disk->slaves.end()) return false;
+        }
+        return true;
+    }), disks.end());
+    return scan_disks(ctx, disks);
+}
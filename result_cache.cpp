@@ -0,0 +1,171 @@
+/*
+ * detect_efi_boot_partition
+ *  Persistent cache of batch results keyed on input file identity(--result-cache)
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "result_cache.h"
+#include "crc32.h"
+
+file_identity file_identity::of(const std::filesystem::path& path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0) throw std::runtime_error("Cannot stat " + path.string() + ": " + strerror(errno));
+    //else
+    return { st.st_dev, st.st_ino, (uint64_t)st.st_size, (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec };
+}
+
+std::string file_identity::to_string() const
+{
+    return std::to_string(dev) + ':' + std::to_string(ino) + ':' + std::to_string(size) + ':' + std::to_string(mtime_ns);
+}
+
+region_recorder::region_recorder(block_reader& reader) : reader_(reader)
+{
+    // the backup GPT is found from the size, so it is part of what the result depends on
+    uint64_t size = reader.size();
+    crc_ = crc32_ieee(&size, sizeof(size));
+}
+
+void region_recorder::record(const void* data, size_t size, uint64_t offset)
+{
+    regions_.emplace_back(offset, size);
+    crc_ = crc32_ieee(data, size, crc_);
+}
+
+void region_recorder::pread(void* buf, size_t size, uint64_t offset)
+{
+    reader_.pread(buf, size, offset);
+    record(buf, size, offset);
+}
+
+const uint8_t* region_recorder::view(uint64_t offset, size_t size)
+{
+    auto data = reader_.view(offset, size);
+    if (data) record(data, size, offset);
+    return data;
+}
+
+bool regions_unchanged(block_reader& reader, const cached_result& result)
+{
+    if (result.regions.empty()) return false;
+    //else
+    region_recorder recorder(reader);
+    std::vector<uint8_t> buf;
+    for (const auto& [offset, size] : result.regions) {
+        if (offset > reader.size() || size > reader.size() - offset) return false;
+        //else
+        if (recorder.view(offset, size)) continue;
+        //else
+        buf.resize(size);
+        recorder.pread(buf.data(), size, offset);
+    }
+    return recorder.crc() == result.crc;
+}
+
+// text, one entry per line:
+//   <vars identity> <image identity>[+<backing file identity>...] <ok|failed> <crc in hex|-> <offset+size,...|-> <json>
+result_cache::result_cache(const std::filesystem::path& path) : path_(path)
+{
+    std::ifstream f(path);
+    std::string line;
+    while (std::getline(f, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        //else
+        std::istringstream in(line);
+        std::string vars, image, status, crc, regions;
+        cached_result result;
+        in >> vars >> image >> status >> crc >> regions >> std::ws;
+        std::getline(in, result.json);
+        if (!in || (status != "ok" && status != "failed") || result.json.empty()) continue;
+        //else
+        result.ok = status == "ok";
+        if (crc != "-" && regions != "-") {
+            result.crc = strtoul(crc.c_str(), nullptr, 16);
+            std::istringstream r(regions);
+            uint64_t offset, size;
+            char plus, comma;
+            while (r >> offset >> plus >> size && plus == '+') {
+                result.regions.emplace_back(offset, size);
+                if (!(r >> comma)) break;
+            }
+        }
+        entries_[vars + ' ' + image] = std::move(result);
+    }
+}
+
+std::string result_cache::key(const file_identity& vars, const file_identity& image, const std::vector<file_identity>& backing)
+{
+    auto key = vars.to_string() + ' ' + image.to_string();
+    for (const auto& file : backing) key += '+' + file.to_string();
+    return key;
+}
+
+std::optional<cached_result> result_cache::find(const std::string& key)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto i = entries_.find(key);
+    if (i == entries_.end()) return std::nullopt;
+    //else
+    used_.insert(key);
+    return i->second;
+}
+
+void result_cache::store(const std::string& key, cached_result result)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_[key] = std::move(result);
+    used_.insert(key);
+}
+
+void result_cache::save() const
+{
+    std::ostringstream out;
+    out << "# detect_efi_boot_partition result cache" << std::endl;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& key : used_) {
+            const auto& result = entries_.at(key);
+            out << key << ' ' << (result.ok? "ok" : "failed") << ' ';
+            if (result.regions.empty()) {
+                out << "- -";
+            } else {
+                out << std::hex << result.crc << std::dec << ' ';
+                for (size_t i = 0; i < result.regions.size(); i++) {
+                    out << (i > 0? "," : "") << result.regions[i].first << '+' << result.regions[i].second;
+                }
+            }
+            out << ' ' << result.json << std::endl;
+        }
+    }
+
+    std::error_code ec;
+    if (path_.has_parent_path()) std::filesystem::create_directories(path_.parent_path(), ec);
+    auto tmp = path_;
+    tmp += ".tmp." + std::to_string(getpid());
+    {
+        std::ofstream f(tmp);
+        f << out.str();
+        f.close();
+        if (!f) {
+            std::filesystem::remove(tmp, ec);
+            throw std::runtime_error("Cannot write " + tmp.string());
+        }
+    }
+    std::filesystem::rename(tmp, path_, ec);
+    if (ec) {
+        std::filesystem::remove(tmp, ec);
+        throw std::runtime_error("Cannot rename " + tmp.string() + " to " + path_.string());
+    }
+}
@@ -0,0 +1,83 @@
+/*
+ * detect_efi_boot_partition
+ *  Persistent cache of batch results keyed on input file identity(--result-cache)
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __RESULT_CACHE_H__
+#define __RESULT_CACHE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <utility>
+#include <optional>
+#include <filesystem>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "partition_table.h"
+
+// what stat(2) says about an input file; a file whose identity is unchanged is taken to be unchanged
+struct file_identity {
+    dev_t dev;
+    ino_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+
+    static file_identity of(const std::filesystem::path& path);  // throws when the file can't be stat'ed
+    std::string to_string() const;  // "<dev>:<ino>:<size>:<mtime ns>"
+};
+
+struct cached_result {
+    bool ok = false;    // the partition was found
+    std::string json;   // result members following "image"(",\"partuuid\":...")
+    // regions of the image the partition table was read from(offset, size) in reading order, and their CRC-32;
+    // empty when the image wasn't read(the efivars gave no answer)
+    std::vector<std::pair<uint64_t, uint64_t>> regions;
+    uint32_t crc = 0;
+};
+
+// passes reads through to another reader, noting where they went and hashing what came back
+class region_recorder : public block_reader {
+    block_reader& reader_;
+    std::vector<std::pair<uint64_t, uint64_t>> regions_;
+    uint32_t crc_;
+    void record(const void* data, size_t size, uint64_t offset);
+public:
+    region_recorder(block_reader& reader);
+    void pread(void* buf, size_t size, uint64_t offset) override;
+    uint64_t size() const override { return reader_.size(); }
+    unsigned int sector_size() const override { return reader_.sector_size(); }
+    const uint8_t* view(uint64_t offset, size_t size) override;
+
+    const std::vector<std::pair<uint64_t, uint64_t>>& regions() const { return regions_; }
+    uint32_t crc() const { return crc_; }
+};
+
+// whether reading result.regions from reader again yields result.crc(false if result has no regions)
+bool regions_unchanged(block_reader& reader, const cached_result& result);
+
+// thread safe; only entries looked up or stored since loading are saved, so entries of VMs gone from the
+// manifest drop out by themselves
+class result_cache {
+    std::filesystem::path path_;
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, cached_result> entries_;
+    std::unordered_set<std::string> used_;
+public:
+    // empty cache when the file is missing or unreadable
+    result_cache(const std::filesystem::path& path);
+
+    // backing: of the files image reads from besides itself(qcow2 backing chain)
+    static std::string key(const file_identity& vars, const file_identity& image, const std::vector<file_identity>& backing);
+    std::optional<cached_result> find(const std::string& key);
+    void store(const std::string& key, cached_result result);
+    // temporary file + rename(2); throws on failure
+    void save() const;
+};
+
+#endif // __RESULT_CACHE_H__
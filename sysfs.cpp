@@ -0,0 +1,220 @@
+/*
+ * detect_efi_boot_partition
+ *  Block device enumeration via sysfs(never opens the devices themselves)
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fnmatch.h>
+#include <sys/sysmacros.h>
+
+#include <fstream>
+#include <algorithm>
+
+#include "sysfs.h"
+
+std::filesystem::path block_device::devpath() const
+{
+    auto devname = name;
+    std::replace(devname.begin(), devname.end(), '!', '/'); // e.g. cciss!c0d0 -> /dev/cciss/c0d0
+    return std::filesystem::path("/dev") / devname;
+}
+
+const char* to_string(device_class cls)
+{
+    switch (cls) {
+    case device_class::disk: return "disk";
+    case device_class::loop: return "loop";
+    case device_class::ram: return "ram";
+    case device_class::zram: return "zram";
+    case device_class::nbd: return "nbd";
+    case device_class::optical: return "optical";
+    case device_class::floppy: return "floppy";
+    case device_class::dm: return "dm";
+    case device_class::md: return "md";
+    }
+    //else
+    return "unknown";
+}
+
+std::optional<device_class> device_class_from_string(const std::string& str)
+{
+    for (auto cls : { device_class::disk, device_class::loop, device_class::ram, device_class::zram,
+        device_class::nbd, device_class::optical, device_class::floppy, device_class::dm, device_class::md }) {
+        if (str == to_string(cls)) return cls;
+    }
+    //else
+    return {};
+}
+
+// static major numbers from Documentation/admin-guide/devices.txt, names for dynamically allocated ones
+static device_class classify(const std::filesystem::path& sysdir, const std::string& name, unsigned int major)
+{
+    std::error_code ec;
+    if (major == 7 || std::filesystem::exists(sysdir / "loop/backing_file", ec)) return device_class::loop;
+    if (major == 1) return device_class::ram;
+    if (major == 2) return device_class::floppy;
+    if (major == 9) return device_class::md;
+    if (major == 11 || read_sysfs_attr(sysdir / "device/type") == "5"/*TYPE_ROM*/) return device_class::optical;
+    if (major == 43) return device_class::nbd;
+    if (name.rfind("zram", 0) == 0) return device_class::zram;
+    if (name.rfind("dm-", 0) == 0) return device_class::dm;
+    if (name.rfind("md", 0) == 0) return device_class::md;
+    //else
+    return device_class::disk;
+}
+
+bool device_filter::accepts(const block_device& dev) const
+{
+    auto matches = [&dev](const std::vector<std::string>& globs) {
+        for (const auto& glob : globs) {
+            if (fnmatch(glob.c_str(), dev.name.c_str(), 0) == 0) return true;
+        }
+        return false;
+    };
+    if (matches(include_globs)) return true;
+    if (matches(exclude_globs)) return false;
+    if (excluded_classes.find(dev.cls) != excluded_classes.end()) return false;
+    if (exclude_removable && dev.removable) return false;
+    //else
+    return true;
+}
+
+std::optional<std::string> read_sysfs_attr(const std::filesystem::path& path)
+{
+    std::ifstream f(path);
+    if (!f) return {};
+    //else
+    std::string value;
+    std::getline(f, value);
+    if (f.bad()) return {};
+    //else
+    return value;
+}
+
+std::vector<block_device> enumerate_block_devices(const std::filesystem::path& sys_class_block)
+{
+    std::vector<block_device> devices;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(sys_class_block, ec)) {
+        block_device dev;
+        dev.name = entry.path().filename().string();
+        auto devnum = read_sysfs_attr(entry.path() / "dev");
+        unsigned int major, minor;
+        if (!devnum || sscanf(devnum->c_str(), "%u:%u", &major, &minor) != 2) continue;
+        dev.devnum = makedev(major, minor);
+        if (auto size = read_sysfs_attr(entry.path() / "size")) dev.size = strtoull(size->c_str(), NULL, 10);
+        if (auto partno = read_sysfs_attr(entry.path() / "partition")) {
+            dev.partno = atoi(partno->c_str());
+            // /sys/class/block/sda1 -> ../../devices/.../block/sda/sda1
+            dev.disk = std::filesystem::canonical(entry.path(), ec).parent_path().filename().string();
+            if (ec) continue;
+        }
+        auto sysdir = dev.is_partition()? entry.path().parent_path() / dev.disk : entry.path();
+        dev.cls = classify(sysdir, dev.is_partition()? dev.disk : dev.name, major);
+        dev.removable = read_sysfs_attr(sysdir / "removable") == "1";
+        if (auto lbs = read_sysfs_attr(sysdir / "queue/logical_block_size")) dev.logical_block_size = std::max(atoi(lbs->c_str()), 512);
+        if (dev.is_partition()) {
+            if (auto start = read_sysfs_attr(entry.path() / "start")) dev.start = strtoull(start->c_str(), NULL, 10);
+        }
+        for (auto [dir, names] : { std::make_pair("holders", &dev.holders), std::make_pair("slaves", &dev.slaves) }) {
+            for (const auto& stacked : std::filesystem::directory_iterator(entry.path() / dir, ec)) {
+                names->push_back(stacked.path().filename().string());
+            }
+        }
+        if (dev.cls == device_class::dm) dev.dm_uuid = read_sysfs_attr(entry.path() / "dm/uuid").value_or("");
+        if (dev.cls == device_class::md) dev.md_level = read_sysfs_attr(entry.path() / "md/level").value_or("");
+        devices.push_back(std::move(dev));
+    }
+    std::sort(devices.begin(), devices.end(), [](const auto& a, const auto& b) { return a.name < b.name; });
+    return devices;
+}
+
+const block_device* find_device(const std::vector<block_device>& devices, const std::string& name)
+{
+    for (const auto& dev : devices) {
+        if (dev.name == name) return &dev;
+    }
+    //else
+    return nullptr;
+}
+
+const block_device* find_device(const std::vector<block_device>& devices, dev_t devnum)
+{
+    for (const auto& dev : devices) {
+        if (dev.devnum == devnum) return &dev;
+    }
+    //else
+    return nullptr;
+}
+
+static bool is_multipath(const block_device& dev) { return dev.dm_uuid.rfind("mpath-", 0) == 0; }
+static bool is_dm_partition(const block_device& dev) { return dev.dm_uuid.rfind("part", 0) == 0; }
+
+const block_device* find_partition(const std::vector<block_device>& devices, const std::string& disk, int partno)
+{
+    for (const auto& dev : devices) {
+        if (dev.disk == disk && dev.partno == partno) return &dev;
+    }
+    //else
+    // kpartx names the dm uuid of partition N of a map "partN-<uuid of the map>"
+    auto prefix = "part" + std::to_string(partno) + "-";
+    for (const auto& dev : devices) {
+        if (dev.dm_uuid.rfind(prefix, 0) == 0 && dev.slaves.size() == 1 && dev.slaves[0] == disk) return &dev;
+    }
+    //else
+    return nullptr;
+}
+
+static const block_device* multipath_map_of(const std::vector<block_device>& devices, const block_device& disk)
+{
+    for (const auto& holder : disk.holders) {
+        auto dev = find_device(devices, holder);
+        if (dev && is_multipath(*dev)) return dev;
+    }
+    //else
+    return nullptr;
+}
+
+std::vector<const block_device*> collapse_stacked(const std::vector<block_device>& devices,
+    const std::vector<const block_device*>& disks, const device_filter& filter)
+{
+    std::vector<const block_device*> representatives;
+    auto add = [&representatives](const block_device* dev) {
+        if (std::find(representatives.begin(), representatives.end(), dev) == representatives.end()) {
+            representatives.push_back(dev);
+        }
+    };
+    for (const auto* disk : disks) {
+        if (is_dm_partition(*disk)) continue;   // read through the map it belongs to
+        //else
+        auto map = multipath_map_of(devices, *disk);
+        add(map && filter.accepts(*map)? map : disk);   // a path stands for itself when dm is filtered out
+    }
+    return representatives;
+}
+
+const block_device* lift_stacked(const std::vector<block_device>& devices, const block_device* dev)
+{
+    if (dev->is_partition()) {
+        auto disk = find_device(devices, dev->disk);
+        auto map = disk? multipath_map_of(devices, *disk) : nullptr;
+        if (map) {
+            if (auto part = find_partition(devices, map->name, *dev->partno)) dev = part;
+        }
+    }
+    for (bool lifted = true; lifted;) {
+        lifted = false;
+        for (const auto& holder : dev->holders) {
+            auto md = find_device(devices, holder);
+            if (md && md->cls == device_class::md && md->md_level == "raid1") {
+                dev = md;
+                lifted = true;
+                break;
+            }
+        }
+    }
+    return dev;
+}
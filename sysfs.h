@@ -0,0 +1,75 @@
+/*
+ * detect_efi_boot_partition
+ *  Block device enumeration via sysfs(never opens the devices themselves)
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __SYSFS_H__
+#define __SYSFS_H__
+
+#include <sys/types.h>
+
+#include <set>
+#include <string>
+#include <vector>
+#include <optional>
+#include <filesystem>
+
+enum class device_class { disk, loop, ram, zram, nbd, optical, floppy, dm, md };
+
+const char* to_string(device_class cls);
+std::optional<device_class> device_class_from_string(const std::string& str);
+
+struct block_device {
+    std::string name;       // kernel name as in /sys/class/block(e.g. "nvme0n1p1")
+    dev_t devnum = 0;
+    uint64_t size = 0;      // in 512 byte sectors
+    uint64_t start = 0;     // partitions only, in 512 byte sectors
+    unsigned int logical_block_size = 512;  // of the(whole) disk
+    std::optional<int> partno;  // set when this is a partition
+    std::string disk;       // for partitions: name of the whole disk device
+    device_class cls = device_class::disk;
+    bool removable = false;
+    std::vector<std::string> holders;   // devices stacked on top of this one(/sys/class/block/*/holders)
+    std::vector<std::string> slaves;    // devices this one is stacked on(/sys/class/block/*/slaves)
+    std::string dm_uuid;    // dm/uuid: "mpath-..." for multipath maps, "partN-..." for their partitions
+    std::string md_level;   // md/level: "raid1" etc.
+
+    bool is_partition() const { return partno.has_value(); }
+    std::filesystem::path devpath() const;   // /dev node
+};
+
+std::optional<std::string> read_sysfs_attr(const std::filesystem::path& path);
+
+std::vector<block_device> enumerate_block_devices(
+    const std::filesystem::path& sys_class_block = "/sys/class/block");
+
+// decides which devices may be opened at all; evaluated from sysfs attributes only
+struct device_filter {
+    std::set<device_class> excluded_classes = {
+        device_class::loop, device_class::ram, device_class::zram, device_class::nbd,
+        device_class::optical, device_class::floppy
+    };
+    std::vector<std::string> include_globs; // matched against kernel names, win over everything else
+    std::vector<std::string> exclude_globs;
+    bool exclude_removable = false;
+
+    bool accepts(const block_device& dev) const;
+};
+
+const block_device* find_device(const std::vector<block_device>& devices, const std::string& name);
+const block_device* find_device(const std::vector<block_device>& devices, dev_t devnum);
+
+// kernel partition device for partition #partno on disk, if any(including kpartx mappings of multipath maps)
+const block_device* find_partition(const std::vector<block_device>& devices, const std::string& disk, int partno);
+
+// one representative per stacked set: multipath paths are replaced by their map(unless filter rejects it),
+// partition mappings are dropped
+std::vector<const block_device*> collapse_stacked(const std::vector<block_device>& devices,
+    const std::vector<const block_device*>& disks, const device_filter& filter);
+
+// top-level device for a partition found on a lower layer: the multipath map's partition instead of
+// one of its paths, and the md RAID1 array(metadata 1.0, ESP mirrored) instead of its member
+const block_device* lift_stacked(const std::vector<block_device>& devices, const block_device* dev);
+
+#endif // __SYSFS_H__
@@ -0,0 +1,55 @@
+#!/bin/sh
+# the offline parsers against the fixtures of mkfixtures.py: each case must find the ESP boot.efivars boots from
+# usage: images.sh <detect_efi_boot_partition binary>
+bin=${1:-./detect_efi_boot_partition}
+dir=$(dirname "$0")
+vars="--replay-efivars $dir/boot.efivars"
+failed=0
+
+# expect <output expected(empty: not found)> <arguments...>
+expect() {
+    want=$1
+    shift
+    got=$("$bin" --quiet "$@")
+    if [ "$got" = "$want" ]; then
+        echo "images: ok: $*"
+    else
+        echo "images: FAIL: $*: got '$got', expected '$want'" >&2
+        failed=1
+    fi
+}
+
+# <start> <size> <partno> <image> of the ESP
+esp() {
+    echo "32768 32768 1 $1"
+}
+
+# GPT: CRCs, the backup header and where it is
+expect "$(esp $dir/gpt.img)" $vars --image $dir/gpt.img
+expect "$(esp $dir/gpt_bad_primary.img)" $vars --image $dir/gpt_bad_primary.img
+expect "$(esp $dir/gpt_bad_entries.img)" $vars --image $dir/gpt_bad_entries.img
+expect "" $vars --image $dir/gpt_bad_both.img
+expect "$(esp $dir/gpt_short.img)" $vars --image $dir/gpt_short.img
+
+# qcow2: L1/L2 lookup and compressed clusters, a raw and a qcow2 backing file under unallocated and zero clusters
+expect "$(esp $dir/qcow2_compressed.qcow2)" $vars --image $dir/qcow2_compressed.qcow2
+expect "$(esp $dir/qcow2_overlay.qcow2)" $vars --image $dir/qcow2_overlay.qcow2
+expect "" $vars --image $dir/qcow2_stale.qcow2
+expect "$(esp $dir/qcow2_chain.qcow2)" $vars --image $dir/qcow2_chain.qcow2
+expect "" $vars --image $dir/qcow2_loop.qcow2
+
+# gzip, xz and zstd: the backup GPT at the end reached by decompressing forward or from an entry point near it
+for image in gpt_4m.img.gz gpt_4m.img.xz gpt_4m.img.zst gpt_4m.seekable.zst; do
+    expect "$(esp $dir/$image)" $vars --image $dir/$image
+done
+
+# OVMF variable stores: State of each copy, authenticated and plain variable headers; BootOrder stands in for BootCurrent
+expect "$(esp $dir/gpt.img)" --ovmf-vars $dir/ovmf_vars.fd --image $dir/gpt.img
+expect "$(esp $dir/gpt.img)" --ovmf-vars $dir/ovmf_vars_plain.fd --image $dir/gpt.img
+# ...but only in a store: replayed elsewhere, the missing BootCurrent stays an error
+snapshot=$(mktemp)
+trap 'rm -f "$snapshot"' EXIT
+"$bin" --quiet --ovmf-vars $dir/ovmf_vars.fd --record-efivars "$snapshot"
+expect "" --replay-efivars "$snapshot" --image $dir/gpt.img
+
+exit $failed
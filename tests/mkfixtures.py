@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+# Generates the disk image fixtures under tests/(make check only uses them; rerun after changing this).
+# Every image holds the ESP boot.efivars boots from: PARTUUID 11111111-2222-3333-4444-555555555555.
+import os, gzip, lzma, struct, uuid, zlib
+
+DIR = os.path.dirname(os.path.abspath(__file__))
+ESP = ('c12a7328-f81f-11d2-ba4b-00a0c93ec93b', '11111111-2222-3333-4444-555555555555')
+LINUX = ('0fc63daf-8483-4772-8e79-3d69d8477de4', '66666666-7777-8888-9999-aaaaaaaaaaaa')
+
+def write(name, data):
+    with open(os.path.join(DIR, name), 'wb') as f: f.write(data)
+
+# GPT disk of nsec 512 byte sectors: ESP at LBA 64-127, a Linux partition at 128-191, 128 entries.
+# table_nsec: the disk size the table was made for(larger: dd'd onto smaller media);
+# stale_primary: the primary entry array lacks the ESP(CRCs valid), so only the backup finds it
+def gpt(nsec=256, table_nsec=None, stale_primary=False):
+    table_nsec = table_nsec or nsec
+    img = bytearray(nsec * 512)
+    img[446:462] = struct.pack('<B3sB3sII', 0, b'\0\0\0', 0xee, b'\0\0\0', 1, nsec - 1)    # protective MBR
+    img[510:512] = b'\x55\xaa'
+    entries = bytearray(128 * 128)
+    for i, ((type_guid, unique_guid), first, last) in enumerate([(ESP, 64, 127), (LINUX, 128, 191)]):
+        entries[i*128:i*128+56] = uuid.UUID(type_guid).bytes_le + uuid.UUID(unique_guid).bytes_le + struct.pack('<QQQ', first, last, 0)
+    def header(my_lba, alternate_lba, entry_lba, entries):
+        h = bytearray(struct.pack('<8sIIIIQQQQ16sQIII', b'EFI PART', 0x10000, 92, 0, 0, my_lba, alternate_lba,
+            34, min(table_nsec - 34, 191), uuid.UUID('deadbeef-0000-1111-2222-333344445555').bytes_le,
+            entry_lba, 128, 128, zlib.crc32(entries)))
+        h[16:20] = struct.pack('<I', zlib.crc32(h))
+        return h
+    primary_entries = (bytes(128) + entries[128:]) if stale_primary else entries
+    img[1024:1024+len(entries)] = primary_entries
+    img[512:512+92] = header(1, table_nsec - 1, 2, primary_entries)
+    if table_nsec == nsec:
+        backup_entry_lba = nsec - 1 - len(entries) // 512
+        img[backup_entry_lba*512:backup_entry_lba*512+len(entries)] = entries
+        img[(nsec-1)*512:(nsec-1)*512+92] = header(nsec - 1, 1, backup_entry_lba, entries)
+    return img
+
+# Boot#### variable data: an option booting from partition #partno(GPT, unique_guid)
+def boot_option(description, partno, first_lba, last_lba, unique_guid):
+    def node(type_, subtype, data): return struct.pack('<BBH', type_, subtype, 4 + len(data)) + data
+    path = node(1, 1, bytes([0, 0x1d])) \
+        + node(4, 1, struct.pack('<IQQ', partno, first_lba, last_lba - first_lba + 1) + uuid.UUID(unique_guid).bytes_le + bytes([2, 2])) \
+        + node(4, 4, '\\EFI\\BOOT\\BOOTX64.EFI\0'.encode('utf-16le')) + node(0x7f, 0xff, b'')
+    return struct.pack('<IH', 1, len(path)) + (description + '\0').encode('utf-16le') + path
+
+# OVMF_VARS.fd-like firmware volume holding a variable store(authenticated or plain variable headers), where only
+# the State of each copy tells which one counts; any of them misread leads to the Linux partition instead of the ESP
+def varstore(authenticated):
+    global_guid = '8be4df61-93ca-11d2-aa0d-00e098032b8c'
+    fv_length = 0x2000
+    fv = bytearray(bytes(16) + uuid.UUID('fff12b8d-7696-4c8b-a985-2747075b4f50').bytes_le + struct.pack('<Q', fv_length)
+        + b'_FVH' + struct.pack('<IHHHBB', 0x4feff, 72, 0, 0, 0, 2) + struct.pack('<IIII', fv_length // 0x1000, 0x1000, 0, 0))
+    fv[50:52] = struct.pack('<H', -sum(struct.unpack('<36H', fv)) & 0xffff)
+    store_guid = 'aaf32c78-947b-439a-a180-2e144ec37792' if authenticated else 'ddcf3616-3275-4164-98b6-fe85707ffe7d'
+    out = fv + uuid.UUID(store_guid).bytes_le + struct.pack('<IBBHI', fv_length - len(fv), 0x5a, 0xfe, 0, 0)
+    def var(name, data, state):
+        nonlocal out
+        while len(out) % 4: out += b'\xff'
+        name = (name + '\0').encode('utf-16le')
+        if authenticated: header = struct.pack('<HBBIQ16sIII', 0x55aa, state, 0, 7, 0, bytes(16), 0, len(name), len(data))
+        else: header = struct.pack('<HBBIII', 0x55aa, state, 0, 7, len(name), len(data))
+        out += header + uuid.UUID(global_guid).bytes_le + name + data
+    added, in_deleted_transition, deleted, header_only = 0x3f, 0x3e, 0x3c, 0x7f
+    to_linux = boot_option('linux', 2, 128, 191, LINUX[1])
+    var('Boot0003', to_linux, deleted)
+    var('Boot0003', to_linux, in_deleted_transition)    # update interrupted: the added copy below wins
+    var('BootOrder', struct.pack('<HH', 3, 1), in_deleted_transition)  # the only copy: still counts
+    var('Boot0001', to_linux, added)
+    var('BootNext', struct.pack('<H', 1), header_only)  # never completed
+    var('Boot0003', boot_option('esp', 1, 64, 127, ESP[1]), added)
+    return out + b'\xff' * (fv_length - len(out))
+
+# qcow2 image of guest(QEMU docs/interop/qcow2.txt) with 1 << cluster_bits byte clusters. Of the clusters, allocated
+# ones are stored(those in compressed deflated), zero ones flagged to read as zeros(version 3), and the rest left to
+# the backing file, or zeros without one
+def qcow2(guest, cluster_bits, version=3, allocated=None, compressed=(), zero=(), backing=None):
+    cluster_size = 1 << cluster_bits
+    nclusters = (len(guest) + cluster_size - 1) // cluster_size
+    if allocated is None: allocated = [c for c in range(nclusters) if guest[c*cluster_size:(c+1)*cluster_size].strip(b'\0')]
+    per_l2 = cluster_size // 8
+    l1_size = (nclusters + per_l2 - 1) // per_l2
+    l1_offset = cluster_size
+    out = bytearray(cluster_size * (2 + (l1_size * 8 - 1) // cluster_size))  # header, L1 table, refcount table
+    l1 = [0] * l1_size
+    l2 = {}
+    for c in sorted(set(allocated) | set(zero)):
+        if c // per_l2 not in l2:
+            l2[c // per_l2] = [0] * per_l2
+            l1[c // per_l2] = len(out) | 1 << 63
+            out += bytes(cluster_size)
+    for c in sorted(set(allocated) | set(zero)):
+        chunk = guest[c*cluster_size:(c+1)*cluster_size].ljust(cluster_size, b'\0')
+        if c in zero:
+            entry = 1
+        elif c in compressed:
+            deflate = zlib.compressobj(9, zlib.DEFLATED, -12)
+            data = deflate.compress(chunk) + deflate.flush()
+            out += bytes(100)   # not sector aligned, as QEMU packs them
+            offset = len(out)
+            out += data
+            sectors = (offset + len(data) - 1) // 512 - offset // 512   # additional 512 byte sectors
+            entry = 1 << 62 | sectors << (62 - (cluster_bits - 8)) | offset
+        else:
+            out += bytes(-len(out) % cluster_size)
+            entry = len(out) | 1 << 63
+            out += chunk
+        l2[c // per_l2][c % per_l2] = entry
+    for i, table in l2.items():
+        offset = l1[i] & ~(1 << 63)
+        out[offset:offset+cluster_size] = struct.pack('>%dQ' % per_l2, *table)
+    out[l1_offset:l1_offset+l1_size*8] = struct.pack('>%dQ' % l1_size, *l1)
+    header = struct.pack('>4sIQIIQIIQQIIQ', b'QFI\xfb', version, 0, 0, cluster_bits, len(guest), 0, l1_size, l1_offset,
+        l1_offset + cluster_size * (1 + (l1_size * 8 - 1) // cluster_size), 1, 0, 0)
+    if version == 3: header += struct.pack('>QQQII', 0, 0, 0, 4, 104)
+    if backing:
+        name = backing.encode()
+        header = header[:8] + struct.pack('>QI', len(header), len(name)) + header[20:] + name
+    out[:len(header)] = header
+    return out
+
+# zstd frame(RFC 8878) of data in raw and RLE blocks; decoding them is all libzstd has to do, finding frames is ours
+def zstd_frame(data):
+    out = struct.pack('<IB', 0xfd2fb528, 0xa0) + struct.pack('<I', len(data))   # single segment, 4 byte content size
+    for offset in range(0, len(data), 4096):    # small blocks: the zeros between the tables go in RLE ones
+        block = data[offset:offset + 4096]
+        last = offset + len(block) == len(data)
+        if block.count(block[:1]) == len(block): out += struct.pack('<I', last | 1 << 1 | len(block) << 3)[:3] + block[:1]
+        else: out += struct.pack('<I', last | len(block) << 3)[:3] + block
+    return out
+
+# zstd seekable format(contrib/seekable_format): a frame per frame_size bytes, then the seek table
+def zstd_seekable(data, frame_size):
+    frames = [zstd_frame(data[offset:offset + frame_size]) for offset in range(0, len(data), frame_size)]
+    table = b''.join(struct.pack('<II', len(frame), min(frame_size, len(data) - i * frame_size)) for i, frame in enumerate(frames))
+    table += struct.pack('<IBI', len(frames), 0, 0x8f92eab1)
+    return b''.join(frames) + struct.pack('<II', 0x184d2a5e, len(table)) + table
+
+def damaged(img, *offsets):
+    img = bytearray(img)
+    for offset in offsets: img[offset] ^= 0xff
+    return img
+
+if __name__ == '__main__':
+    plain = gpt()
+    write('gpt.img', plain)
+    write('gpt_bad_primary.img', damaged(plain, 512 + 40))          # primary header CRC: backup header used
+    write('gpt_bad_entries.img', damaged(plain, 1024 + 5))          # primary entry array CRC: backup used
+    write('gpt_bad_both.img', damaged(plain, 512 + 40, 255 * 512 + 40))     # nothing usable
+    write('gpt_short.img', gpt(nsec=256, table_nsec=512))           # backup past the end: primary kept
+    # qcow2: 512 byte clusters make 4 L2 tables; the table clusters are compressed
+    write('qcow2_compressed.qcow2', qcow2(plain, 9, compressed=range(0, 34)))
+    # an overlay(version 2, 4 KiB clusters) holding the intact primary header over a raw backing file lacking it
+    write('qcow2_overlay.qcow2', qcow2(plain, 12, version=2, allocated=[0], backing='gpt_bad_primary.img'))
+    # a chain: the top image zeroes the primary header of a stale primary table below, leaving the backup to find the ESP
+    write('qcow2_stale.qcow2', qcow2(gpt(stale_primary=True), 9))
+    write('qcow2_chain.qcow2', qcow2(plain, 9, allocated=[], zero=[1], backing='qcow2_stale.qcow2'))
+    write('qcow2_loop.qcow2', qcow2(plain, 9, allocated=[], backing='qcow2_loop.qcow2'))
+    # compressed raw images of a 4 MiB disk with its primary GPT damaged: the backup in the last MiB has to be reached
+    # past the MiB kept decompressed, through the entry points of each format(xz: a stream per MiB)
+    big = damaged(gpt(nsec=8192), 512 + 40)
+    write('gpt_4m.img.gz', gzip.compress(big, mtime=0))
+    write('gpt_4m.img.xz', b''.join(lzma.compress(big[offset:offset + 1024 * 1024]) for offset in range(0, len(big), 1024 * 1024)))
+    write('gpt_4m.img.zst', zstd_frame(big))
+    write('gpt_4m.seekable.zst', zstd_seekable(big, 1024 * 1024))
+    write('ovmf_vars.fd', varstore(authenticated=True))
+    write('ovmf_vars_plain.fd', varstore(authenticated=False))
@@ -0,0 +1,23 @@
+#!/bin/sh
+# --no-device-io: no block device gets opened, and a partition left unfound says why
+# usage: no_device_io.sh <detect_efi_boot_partition binary>
+bin=${1:-./detect_efi_boot_partition}
+dir=$(dirname "$0")
+metrics=$(mktemp)
+trap 'rm -f "$metrics"' EXIT
+
+"$bin" --quiet --replay-efivars "$dir/boot.efivars" --no-device-io --metrics-file "$metrics"
+rst=$?
+
+if ! grep -qx 'detect_efi_boot_partition_device_opens 0' "$metrics"; then
+    echo "no_device_io: block devices were opened" >&2
+    cat "$metrics" >&2
+    exit 1
+fi
+# the snapshot's PARTUUID(11111111-2222-3333-4444-555555555555) isn't expected to be on the host
+if [ $rst -ne 0 ] && ! grep -q 'failure{reason="device_io_forbidden"} 1' "$metrics"; then
+    echo "no_device_io: failure not reported as device_io_forbidden" >&2
+    cat "$metrics" >&2
+    exit 1
+fi
+echo "no_device_io: ok"
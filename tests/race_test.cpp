@@ -0,0 +1,75 @@
+/*
+ * detect_efi_boot_partition
+ *  --race with a backend stuck far longer than the winner takes(make check)
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <unistd.h>
+
+#include <thread>
+#include <chrono>
+#include <iostream>
+
+#include "resolver.h"
+#include "metrics.h"
+
+static std::optional<std::filesystem::path> answer_at_once(lookup_context&)
+{
+    return std::filesystem::path("/dev/fast");
+}
+
+// a read from a disk that doesn't wake up; ignores cancellation and keeps using the statics racers use
+static std::optional<std::filesystem::path> answer_late(lookup_context&)
+{
+    auto until = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (std::chrono::steady_clock::now() < until) {
+        trace("slow backend still reading");
+        metrics.devices_scanned++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return {};
+}
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+    std::cerr << (ok? "ok: " : "FAIL: ") << what << std::endl;
+    if (!ok) failures++;
+}
+
+int main()
+{
+    register_backend({ "test-fast", false, false, 0.0, answer_at_once });
+    register_backend({ "test-slow", false, false, 0.0, answer_late });
+
+    resolver_options options;
+    options.race = true;
+    options.backends = { "test-slow", "test-fast" };
+    partition_query query;
+    query.partuuid = "11111111-2222-3333-4444-555555555555";
+
+    auto start = std::chrono::steady_clock::now();
+    auto found = resolve_partition(query, options);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    check(found && *found == "/dev/fast", "the fast backend wins");
+    check(elapsed.count() < 0.5, "the winner isn't held up by the slow backend");
+    check(racers_running(), "the slow racer is reported running after the race");
+
+    for (int i = 0; i < 200 && racers_running(); i++) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    check(!racers_running(), "racers_running() clears once the slow racer is done");
+
+    // this one leaves a slow racer behind that is still running when main() ends below
+    found = resolve_partition(query, options);
+    check(found && *found == "/dev/fast", "the fast backend wins again");
+
+    std::cerr << (failures? "race_test: failed" : "race_test: ok") << std::endl;
+    // ending as main() of detect_efi_boot_partition does
+    if (racers_running()) {
+        std::cout.flush();
+        _exit(failures? 1 : 0);
+    }
+    //else
+    return failures? 1 : 0;
+}
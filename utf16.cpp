@@ -0,0 +1,76 @@
+/*
+ * detect_efi_boot_partition
+ *  UTF-16LE decoding for EFI strings
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <string.h>
+
+#include "utf16.h"
+
+std::optional<uint32_t> next_utf16le(const uint8_t*& p, const uint8_t* end)
+{
+    if (end - p < 2) return 0;
+    //else
+    uint32_t cp = p[0] | (p[1] << 8);
+    p += 2;
+    if (cp >= 0xdc00 && cp <= 0xdfff) return std::nullopt;
+    //else
+    if (cp < 0xd800 || cp > 0xdbff) return cp;
+    //else
+    // high surrogate: needs a low one next
+    if (end - p < 2) return std::nullopt;
+    //else
+    uint32_t low = p[0] | (p[1] << 8);
+    if (low < 0xdc00 || low > 0xdfff) return std::nullopt;
+    //else
+    p += 2;
+    return 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+}
+
+size_t encode_utf8(uint32_t cp, char out[4])
+{
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    }
+    //else
+    if (cp < 0x800) {
+        out[0] = (char)(0xc0 | cp >> 6);
+        out[1] = (char)(0x80 | (cp & 0x3f));
+        return 2;
+    }
+    //else
+    if (cp < 0x10000) {
+        out[0] = (char)(0xe0 | cp >> 12);
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        out[2] = (char)(0x80 | (cp & 0x3f));
+        return 3;
+    }
+    //else
+    out[0] = (char)(0xf0 | cp >> 18);
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+    out[3] = (char)(0x80 | (cp & 0x3f));
+    return 4;
+}
+
+std::optional<size_t> utf16le_to_utf8(const uint8_t* src, size_t src_bytes, char* out, size_t out_size)
+{
+    size_t len = 0;
+    const uint8_t* end = src + src_bytes;
+    while (true) {
+        auto cp = next_utf16le(src, end);
+        if (!cp) return std::nullopt;
+        //else
+        if (*cp == 0) return len;
+        //else
+        char utf8[4];
+        auto n = encode_utf8(*cp, utf8);
+        if (len + n > out_size) return std::nullopt;
+        //else
+        memcpy(out + len, utf8, n);
+        len += n;
+    }
+}
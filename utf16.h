@@ -0,0 +1,27 @@
+/*
+ * detect_efi_boot_partition
+ *  UTF-16LE decoding for EFI strings
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __UTF16_H__
+#define __UTF16_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <optional>
+
+// next code point of the UTF-16LE string at p(before end), advancing p; 0 at the end or a NUL.
+// std::nullopt on an unpaired surrogate.
+std::optional<uint32_t> next_utf16le(const uint8_t*& p, const uint8_t* end);
+
+// UTF-8 encoding of cp into out; returns its length(1-4)
+size_t encode_utf8(uint32_t cp, char out[4]);
+
+// UTF-16LE(EFI variables, device path nodes) to UTF-8 into out[0..out_size), stopping at a NUL
+// or after src_bytes. No allocation. Returns the number of bytes written(without terminator),
+// or std::nullopt on an unpaired surrogate or when out is too small.
+std::optional<size_t> utf16le_to_utf8(const uint8_t* src, size_t src_bytes, char* out, size_t out_size);
+
+#endif // __UTF16_H__
@@ -0,0 +1,209 @@
+/*
+ * detect_efi_boot_partition
+ *  EDK2 variable store files(OVMF_VARS.fd)
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "varstore.h"
+#include "utf16.h"
+#include "metrics.h"
+
+// EFI_FIRMWARE_VOLUME_HEADER(PI spec vol.3 3.2.1), followed by the block map
+struct __attribute__((packed)) fv_header_t {
+    uint8_t zero_vector[16];
+    uint8_t file_system_guid[16];
+    uint64_t fv_length;
+    char signature[4];
+    uint32_t attributes;
+    uint16_t header_length;
+    uint16_t checksum;
+    uint16_t ext_header_offset;
+    uint8_t reserved;
+    uint8_t revision;
+};
+static_assert(sizeof(fv_header_t) == 56);
+
+// VARIABLE_STORE_HEADER(EDK2 MdeModulePkg/Include/Guid/VariableFormat.h)
+struct __attribute__((packed)) variable_store_header_t {
+    uint8_t signature[16];
+    uint32_t size;
+    uint8_t format;
+    uint8_t state;
+    uint16_t reserved;
+    uint32_t reserved1;
+};
+static_assert(sizeof(variable_store_header_t) == 28);
+
+struct __attribute__((packed)) variable_header_t {
+    uint16_t start_id;
+    uint8_t state;
+    uint8_t reserved;
+    uint32_t attributes;
+    uint32_t name_size;
+    uint32_t data_size;
+    uint8_t vendor_guid[16];
+};
+static_assert(sizeof(variable_header_t) == 32);
+
+struct __attribute__((packed)) authenticated_variable_header_t {
+    uint16_t start_id;
+    uint8_t state;
+    uint8_t reserved;
+    uint32_t attributes;
+    uint64_t monotonic_count;
+    uint8_t timestamp[16];
+    uint32_t pubkey_index;
+    uint32_t name_size;
+    uint32_t data_size;
+    uint8_t vendor_guid[16];
+};
+static_assert(sizeof(authenticated_variable_header_t) == 60);
+
+static constexpr Guid nv_data_fv_guid = Guid::literal("fff12b8d-7696-4c8b-a985-2747075b4f50");
+static constexpr Guid variable_store_guid = Guid::literal("ddcf3616-3275-4164-98b6-fe85707ffe7d");
+static constexpr Guid authenticated_variable_store_guid = Guid::literal("aaf32c78-947b-439a-a180-2e144ec37792");
+
+static const uint8_t variable_store_formatted = 0x5a, variable_store_healthy = 0xfe;
+static const uint16_t variable_start_id = 0x55aa;
+// State bits are cleared one by one as a variable is written and deleted(flash semantics)
+static const uint8_t var_added = 0x3f, var_in_deleted_transition = 0xfe;
+static const size_t header_alignment = 4;
+
+edk2_varstore::edk2_varstore(const std::filesystem::path& file)
+{
+    int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("Cannot open " + file.string() + ": " + strerror(errno));
+    //else
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(fv_header_t) + sizeof(variable_store_header_t)) {
+        ::close(fd);
+        throw std::runtime_error(file.string() + " is not an EDK2 variable store");
+    }
+    //else
+    size_ = st.st_size;
+    auto map = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) throw std::runtime_error("Cannot map " + file.string());
+    //else
+    map_ = (const uint8_t*)map;
+    try {
+        const auto& fv = *(const fv_header_t*)map_;
+        if (memcmp(fv.signature, "_FVH", 4) != 0 || Guid::from_efi_bytes(fv.file_system_guid) != nv_data_fv_guid) {
+            throw std::runtime_error(file.string() + " is not an EDK2 variable store(no NV data firmware volume)");
+        }
+        //else
+        auto header_length = le16toh(fv.header_length);
+        auto fv_length = le64toh(fv.fv_length);
+        if (header_length < sizeof(fv_header_t) || header_length % 2 != 0
+            || fv_length > size_ || header_length + sizeof(variable_store_header_t) > fv_length) {
+            throw std::runtime_error(file.string() + ": firmware volume header out of bounds");
+        }
+        //else
+        uint16_t sum = 0;   // of the header as 16 bit words, checksum field included
+        for (size_t i = 0; i < header_length; i += 2) sum += map_[i] | map_[i + 1] << 8;
+        if (sum != 0) throw std::runtime_error(file.string() + ": firmware volume header checksum mismatch");
+        //else
+        const uint8_t* store = map_ + header_length;
+        const auto& store_header = *(const variable_store_header_t*)store;
+        auto store_guid = Guid::from_efi_bytes(store_header.signature);
+        bool authenticated = store_guid == authenticated_variable_store_guid;
+        if (!authenticated && store_guid != variable_store_guid) {
+            throw std::runtime_error(file.string() + ": unknown variable store " + store_guid.to_string());
+        }
+        //else
+        if (store_header.format != variable_store_formatted) throw std::runtime_error(file.string() + ": variable store not formatted");
+        //else
+        if (store_header.state != variable_store_healthy) trace(file.string(), ": variable store not marked healthy, reading it anyway");
+        size_t store_size = std::min<uint64_t>(le32toh(store_header.size), fv_length - header_length);
+        index_variables(store, store_size, authenticated);
+    }
+    catch (...) {
+        munmap(map, size_);
+        throw;
+    }
+}
+
+// walks the variables from after the store header up to the first slot never written(erased flash: 0xff)
+void edk2_varstore::index_variables(const uint8_t* store, size_t store_size, bool authenticated)
+{
+    size_t header_size = authenticated? sizeof(authenticated_variable_header_t) : sizeof(variable_header_t);
+    size_t pos = sizeof(variable_store_header_t);
+    size_t skipped = 0;
+    std::vector<char> name_buf;
+    while (pos <= store_size && store_size - pos >= header_size) {
+        const uint8_t* p = store + pos;
+        uint16_t start_id;
+        uint8_t state;
+        uint32_t attributes, name_size, data_size;
+        const uint8_t* vendor_guid;
+        if (authenticated) {
+            const auto& header = *(const authenticated_variable_header_t*)p;
+            start_id = le16toh(header.start_id), state = header.state, attributes = le32toh(header.attributes);
+            name_size = le32toh(header.name_size), data_size = le32toh(header.data_size), vendor_guid = header.vendor_guid;
+        } else {
+            const auto& header = *(const variable_header_t*)p;
+            start_id = le16toh(header.start_id), state = header.state, attributes = le32toh(header.attributes);
+            name_size = le32toh(header.name_size), data_size = le32toh(header.data_size), vendor_guid = header.vendor_guid;
+        }
+        if (start_id != variable_start_id) break;
+        //else
+        if ((uint64_t)name_size + data_size > store_size - pos - header_size) {
+            trace("variable store: variable at offset ", pos, " runs past the end of the store");
+            break;
+        }
+        //else
+        const uint8_t* name = p + header_size;
+        const uint8_t* data = name + name_size;
+        pos = (pos + header_size + name_size + data_size + header_alignment - 1) / header_alignment * header_alignment;
+
+        bool in_deleted_transition = state == (var_added & var_in_deleted_transition);
+        if (state != var_added && !in_deleted_transition) { skipped++; continue; }
+        //else
+        name_buf.resize(name_size / 2 * 3 + 1);     // a UTF-16 code unit takes at most 3 bytes in UTF-8
+        auto name_len = utf16le_to_utf8(name, name_size, name_buf.data(), name_buf.size());
+        if (!name_len) { skipped++; continue; }
+        //else
+        auto key = std::string(name_buf.data(), *name_len) + "-" + Guid::from_efi_bytes(vendor_guid).to_string();
+        variable var { attributes, data, data_size, in_deleted_transition };
+        auto [i, inserted] = index_.emplace(key, var);
+        // of an update interrupted midway the old copy is still in transition while the new one is added
+        if (!inserted && (i->second.in_deleted_transition || !in_deleted_transition)) i->second = var;
+    }
+    trace("variable store: ", index_.size(), " variables, ", skipped, " deleted or incomplete skipped");
+}
+
+edk2_varstore::~edk2_varstore()
+{
+    munmap((void*)map_, size_);
+}
+
+std::optional<std::vector<uint8_t>> edk2_varstore::read(const std::string& name) const
+{
+    auto i = index_.find(name);
+    if (i == index_.end()) return std::nullopt;
+    //else
+    const auto& var = i->second;
+    std::vector<uint8_t> contents(4 + var.size);
+    auto attributes_le = htole32(var.attributes);
+    memcpy(contents.data(), &attributes_le, 4);
+    memcpy(contents.data() + 4, var.data, var.size);
+    return contents;
+}
+
+std::vector<std::string> edk2_varstore::list() const
+{
+    std::vector<std::string> names;
+    for (const auto& [name, var] : index_) names.push_back(name);
+    return names;
+}
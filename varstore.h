@@ -0,0 +1,46 @@
+/*
+ * detect_efi_boot_partition
+ *  EDK2 variable store files(OVMF_VARS.fd)
+ *
+ * Copyright (c) 2023 Tomoatsu Shimada
+ */
+#ifndef __VARSTORE_H__
+#define __VARSTORE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+#include <optional>
+#include <filesystem>
+#include <unordered_map>
+
+#include "efivars.h"
+
+// The non-volatile variables of a VM as its firmware(OVMF, AAVMF) keeps them, read out of the file mapped
+// read-only: a firmware volume header, then a variable store of VARIABLE_HEADERs(AUTHENTICATED_VARIABLE_HEADERs
+// in an authenticated store). Variables deleted or only half written according to their State are skipped.
+// BootCurrent is volatile and never in there.
+class edk2_varstore : public efivar_source {
+    struct variable {
+        uint32_t attributes;
+        const uint8_t* data;
+        uint32_t size;
+        bool in_deleted_transition;     // superseded by a VAR_ADDED copy if there is one
+    };
+    const uint8_t* map_ = nullptr;
+    size_t size_ = 0;
+    std::unordered_map<std::string, variable> index_;   // name-GUID -> variable
+    void index_variables(const uint8_t* store, size_t store_size, bool authenticated);
+public:
+    explicit edk2_varstore(const std::filesystem::path& file);   // throws when not a variable store
+    ~edk2_varstore();
+    edk2_varstore(const edk2_varstore&) = delete;
+    edk2_varstore& operator=(const edk2_varstore&) = delete;
+    std::optional<std::vector<uint8_t>> read(const std::string& name) const override;
+    std::vector<std::string> list() const override;
+    bool has_volatile_variables() const override { return false; }
+};
+
+#endif // __VARSTORE_H__